@@ -0,0 +1,114 @@
+#include <stddef.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "utils.h"
+
+static const char *phase_names[ALLOC_END] = { "other", "step", "draw", "sync" };
+
+static struct {
+	uint64_t allocs[ALLOC_END];
+	uint64_t bytes[ALLOC_END];
+	uint64_t frees[ALLOC_END];
+	/* Step and draw allocations at the last check */
+	uint64_t checked;
+	/* Frames past the warm-up which allocated */
+	uint64_t violations;
+	int strict;
+} alloc;
+
+static __thread enum scroll_alloc_phase thread_phase;
+
+void scroll_alloc_phase(enum scroll_alloc_phase phase) {
+	thread_phase = phase;
+}
+
+#ifdef ALLOC_TRACK
+
+/* Built with ALLOCFLAGS, scroll interposes the allocator for the whole process */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t num, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+/* Can't use stdio, it may allocate itself */
+static void scroll_alloc_count(size_t size) {
+	enum scroll_alloc_phase phase = thread_phase;
+
+	if (alloc.strict && (phase == ALLOC_STEP || phase == ALLOC_DRAW)) {
+		static const char msg[] = "ERROR: Allocation while stepping or drawing after the warm-up\n";
+		write(2, msg, sizeof(msg) - 1);
+		abort();
+	}
+
+	__atomic_fetch_add(&alloc.allocs[phase], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&alloc.bytes[phase], size, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+	scroll_alloc_count(size);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t num, size_t size) {
+	scroll_alloc_count(num * size);
+	return __libc_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	scroll_alloc_count(size);
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+	if (ptr)
+		__atomic_fetch_add(&alloc.frees[thread_phase], 1, __ATOMIC_RELAXED);
+	__libc_free(ptr);
+}
+
+int scroll_alloc_tracking(void) {
+	return 1;
+}
+
+#else
+
+int scroll_alloc_tracking(void) {
+	return 0;
+}
+
+#endif
+
+/* After every frame, compares the step and draw allocations with the last frame's */
+void scroll_alloc_check(int warm) {
+	uint64_t allocs = __atomic_load_n(&alloc.allocs[ALLOC_STEP], __ATOMIC_RELAXED) +
+		__atomic_load_n(&alloc.allocs[ALLOC_DRAW], __ATOMIC_RELAXED);
+
+	if (warm && allocs != alloc.checked && !alloc.violations++)
+		_warn("A frame allocated %llu times while stepping or drawing after the warm-up",
+			(unsigned long long) (allocs - alloc.checked));
+	alloc.checked = allocs;
+
+#ifdef DEBUG
+	/* Abort right at the allocation, so the core has the culprit's stack */
+	alloc.strict = warm;
+#endif
+}
+
+void scroll_alloc_report(uint64_t frames) {
+	if (!scroll_alloc_tracking())
+		return;
+
+	double per_frame = frames ? frames : 1;
+	for (int i = ALLOC_STEP; i < ALLOC_END; ++i) {
+		_log("Allocations: %-5s %.2f allocations, %.1f bytes and %.2f frees per frame", phase_names[i],
+			__atomic_load_n(&alloc.allocs[i], __ATOMIC_RELAXED) / per_frame,
+			__atomic_load_n(&alloc.bytes[i], __ATOMIC_RELAXED) / per_frame,
+			__atomic_load_n(&alloc.frees[i], __ATOMIC_RELAXED) / per_frame);
+	}
+	_log("Allocations: %-5s %llu allocations of %llu bytes and %llu frees", phase_names[ALLOC_OTHER],
+		(unsigned long long) __atomic_load_n(&alloc.allocs[ALLOC_OTHER], __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&alloc.bytes[ALLOC_OTHER], __ATOMIC_RELAXED),
+		(unsigned long long) __atomic_load_n(&alloc.frees[ALLOC_OTHER], __ATOMIC_RELAXED));
+	if (alloc.violations)
+		_log("Allocations: %llu frames allocated after the warm-up", (unsigned long long) alloc.violations);
+}
@@ -0,0 +1,23 @@
+#ifndef __alloc_h__
+#define __alloc_h__
+
+#include <stdint.h>
+
+/* Frames before --alloc-check expects the loop to stop allocating */
+#define ALLOC_WARMUP_FRAMES 120
+
+/* What the main thread is doing, other threads always count as other */
+enum scroll_alloc_phase {
+	ALLOC_OTHER = 0,
+	ALLOC_STEP,
+	ALLOC_DRAW,
+	ALLOC_SYNC,
+	ALLOC_END
+};
+
+int scroll_alloc_tracking(void);
+void scroll_alloc_phase(enum scroll_alloc_phase phase);
+void scroll_alloc_check(int warm);
+void scroll_alloc_report(uint64_t frames);
+
+#endif
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#include <Imlib2.h>
+
+#include "scale.h"
+#include "utils.h"
+
+/* Compares the scaler with Imlib on 4K and 8K targets */
+
+#define BENCH_RUNS 5
+
+int scroll_verbose = 0;
+
+struct bench_target {
+	const char *name;
+	int width, height;
+};
+
+static const struct bench_target targets[] = {
+	{ "4K", 3840, 2160 },
+	{ "8K", 7680, 4320 },
+};
+
+static double seconds(void) {
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return spec.tv_sec + spec.tv_nsec / 1e9;
+}
+
+/* Gradients with a checkerboard, so the filters have edges to work on */
+static void bench_synthetic(struct scroll_image *image, int width, int height) {
+	image->width = image->full_width = width;
+	image->height = image->full_height = height;
+	image->pixels = malloc(sizeof(uint32_t) * width * height);
+	_check_or_die(image->pixels, "Failed to allocate %dx%d image", width, height);
+
+	for (int y = 0; y < height; ++y) {
+		for (int x = 0; x < width; ++x) {
+			uint32_t check = ((x / 64 + y / 64) & 1) * 0xff;
+			image->pixels[(size_t) y * width + x] = 0xff000000 | (x * 255 / width) << 16 |
+				(y * 255 / height) << 8 | check;
+		}
+	}
+
+	image->handle = imlib_create_image_using_data(width, height, image->pixels);
+}
+
+static int bench_load(struct scroll_image *image, const char *path) {
+	image->handle = imlib_load_image_immediately(path);
+	if (!image->handle)
+		return 0;
+
+	imlib_context_set_image(image->handle);
+	image->width = image->full_width = imlib_image_get_width();
+	image->height = image->full_height = imlib_image_get_height();
+	image->pixels = imlib_image_get_data_for_reading_only();
+	return 1;
+}
+
+/* Best of BENCH_RUNS, in milliseconds */
+static double bench_scale(const struct scroll_image *image, const struct scroll_format *fmt,
+	enum scroll_filter filter, int linear, const struct bench_target *target) {
+	double best = -1;
+
+	for (int i = 0; i < BENCH_RUNS; ++i) {
+		struct scroll_scaled scaled = { target->width, target->height, 0, NULL };
+		double start = seconds();
+		scroll_scale(image, fmt, filter, linear, &scaled);
+		double t = (seconds() - start) * 1000;
+		scroll_scaled_free(&scaled);
+
+		if (best < 0 || t < best)
+			best = t;
+	}
+
+	return best;
+}
+
+static double bench_imlib(const struct scroll_image *image, const struct bench_target *target) {
+	double best = -1;
+
+	imlib_context_set_anti_alias(1);
+	for (int i = 0; i < BENCH_RUNS; ++i) {
+		imlib_context_set_image(image->handle);
+		double start = seconds();
+		Imlib_Image scaled = imlib_create_cropped_scaled_image(0, 0, image->width, image->height,
+			target->width, target->height);
+		double t = (seconds() - start) * 1000;
+		imlib_context_set_image(scaled);
+		imlib_free_image();
+
+		if (best < 0 || t < best)
+			best = t;
+	}
+
+	return best;
+}
+
+/* Scaling and uploading to a pixmap, including the round trip */
+static void bench_x11(const struct scroll_image *image, const struct bench_target *target) {
+	Display *display = XOpenDisplay(NULL);
+	if (!display) {
+		printf("  no display, skipping upload\n");
+		return;
+	}
+
+	int screen = DefaultScreen(display);
+	Visual *visual = DefaultVisual(display, screen);
+	int depth = DefaultDepth(display, screen);
+	Pixmap pixmap = XCreatePixmap(display, RootWindow(display, screen), target->width, target->height, depth);
+	GC gc = XCreateGC(display, pixmap, 0, NULL);
+
+	struct scroll_format fmt;
+	if (scroll_format_init(&fmt, display, visual, depth)) {
+		double start = seconds();
+		struct scroll_scaled scaled = { target->width, target->height, 0, NULL };
+		scroll_scale(image, &fmt, FILTER_BILINEAR, 1, &scaled);
+		scroll_scaled_put(display, visual, depth, pixmap, gc, &scaled);
+		XSync(display, False);
+		scroll_scaled_free(&scaled);
+		printf("  %-10s %8.1f ms to pixmap\n", "scroll", (seconds() - start) * 1000);
+	}
+
+	imlib_context_set_display(display);
+	imlib_context_set_visual(visual);
+	imlib_context_set_colormap(DefaultColormap(display, screen));
+	imlib_context_set_drawable(pixmap);
+	imlib_context_set_image(image->handle);
+	imlib_context_set_anti_alias(1);
+
+	double start = seconds();
+	imlib_render_image_on_drawable_at_size(0, 0, target->width, target->height);
+	XSync(display, False);
+	printf("  %-10s %8.1f ms to pixmap\n", "imlib", (seconds() - start) * 1000);
+
+	XFreeGC(display, gc);
+	XFreePixmap(display, pixmap);
+	XCloseDisplay(display);
+}
+
+int main(int argc, char **argv) {
+	struct scroll_image image;
+	memset(&image, 0, sizeof(struct scroll_image));
+
+	if (argc == 3 && !strcmp(argv[1], "-i")) {
+		_check_or_die(bench_load(&image, argv[2]), "Failed to load %s", argv[2]);
+	} else if (argc == 1) {
+		bench_synthetic(&image, 6000, 4000);
+	} else {
+		printf("Usage %s [-i IMAGE]\n", argv[0]);
+		return 1;
+	}
+
+	/* Plain 32 bit ARGB, the most common visual */
+	struct scroll_format fmt = { 4, 16, 8, 0, 8, 8, 8 };
+
+	printf("Source %dx%d, best of %d\n", image.width, image.height, BENCH_RUNS);
+	for (size_t i = 0; i < sizeof(targets) / sizeof(targets[0]); ++i) {
+		const struct bench_target *target = &targets[i];
+		printf("%s (%dx%d)\n", target->name, target->width, target->height);
+
+		for (int filter = 0; filter < FILTER_END; ++filter) {
+			printf("  %-10s %8.1f ms sRGB %8.1f ms linear\n", scroll_filter_name(filter),
+				bench_scale(&image, &fmt, filter, 0, target), bench_scale(&image, &fmt, filter, 1, target));
+		}
+		printf("  %-10s %8.1f ms\n", "imlib", bench_imlib(&image, target));
+
+		bench_x11(&image, target);
+	}
+
+	imlib_context_set_image(image.handle);
+	imlib_free_image();
+	return 0;
+}
@@ -0,0 +1,120 @@
+#include <stdlib.h>
+
+#include "budget.h"
+#include "utils.h"
+
+static const char *kind_names[BUDGET_END] = { "image", "scaled", "cache", "pixmaps" };
+
+void scroll_budget_init(struct scroll_budget *budget, size_t limit) {
+	budget->limit = limit;
+	for (int i = 0; i < BUDGET_END; ++i)
+		budget->used[i] = 0;
+	budget->peak = 0;
+
+	pthread_mutex_init(&budget->lock, NULL);
+	pthread_cond_init(&budget->cond, NULL);
+}
+
+/* Parses sizes like 256M, returns 0 if the size is invalid */
+size_t scroll_budget_parse(const char *str) {
+	char *end;
+	double size = strtod(str, &end);
+
+	switch (*end) {
+	case 'G':
+	case 'g':
+		size *= 1024;
+		/* fall through */
+	case 'M':
+	case 'm':
+		size *= 1024;
+		/* fall through */
+	case 'K':
+	case 'k':
+		size *= 1024;
+		++end;
+		break;
+	}
+
+	if (end == str || *end || size < 1)
+		return 0;
+	return size;
+}
+
+const char *scroll_budget_name(enum scroll_budget_kind kind) {
+	return kind_names[kind];
+}
+
+static size_t total(struct scroll_budget *budget) {
+	size_t res = 0;
+	for (int i = 0; i < BUDGET_END; ++i)
+		res += budget->used[i];
+	return res;
+}
+
+/* Called with the lock held after the usage grew */
+static void update_peak(struct scroll_budget *budget) {
+	size_t used = total(budget);
+	if (used > budget->peak)
+		budget->peak = used;
+}
+
+void scroll_budget_add(struct scroll_budget *budget, enum scroll_budget_kind kind, size_t bytes) {
+	pthread_mutex_lock(&budget->lock);
+	budget->used[kind] += bytes;
+	update_peak(budget);
+	pthread_mutex_unlock(&budget->lock);
+}
+
+void scroll_budget_sub(struct scroll_budget *budget, enum scroll_budget_kind kind, size_t bytes) {
+	pthread_mutex_lock(&budget->lock);
+	budget->used[kind] -= MIN(bytes, budget->used[kind]);
+	pthread_cond_broadcast(&budget->cond);
+	pthread_mutex_unlock(&budget->lock);
+}
+
+void scroll_budget_set(struct scroll_budget *budget, enum scroll_budget_kind kind, size_t bytes) {
+	pthread_mutex_lock(&budget->lock);
+	budget->used[kind] = bytes;
+	update_peak(budget);
+	pthread_cond_broadcast(&budget->cond);
+	pthread_mutex_unlock(&budget->lock);
+}
+
+/* Adds the bytes once they fit, waiting for other scaled buffers to be released meanwhile.
+ * Goes over the limit if nothing is left to wait for and returns 0 then. */
+int scroll_budget_reserve(struct scroll_budget *budget, enum scroll_budget_kind kind, size_t bytes) {
+	int fits;
+
+	pthread_mutex_lock(&budget->lock);
+	while (budget->limit && total(budget) + bytes > budget->limit && budget->used[BUDGET_SCALED])
+		pthread_cond_wait(&budget->cond, &budget->lock);
+
+	fits = !budget->limit || total(budget) + bytes <= budget->limit;
+	budget->used[kind] += bytes;
+	update_peak(budget);
+	pthread_mutex_unlock(&budget->lock);
+
+	return fits;
+}
+
+size_t scroll_budget_used(struct scroll_budget *budget) {
+	pthread_mutex_lock(&budget->lock);
+	size_t res = total(budget);
+	pthread_mutex_unlock(&budget->lock);
+	return res;
+}
+
+/* Bytes left before reaching the limit, SIZE_MAX if unlimited */
+size_t scroll_budget_available(struct scroll_budget *budget) {
+	if (!budget->limit)
+		return SIZE_MAX;
+
+	size_t used = scroll_budget_used(budget);
+	return used < budget->limit ? budget->limit - used : 0;
+}
+
+void scroll_budget_free(struct scroll_budget *budget) {
+	pthread_mutex_destroy(&budget->lock);
+	pthread_cond_destroy(&budget->cond);
+}
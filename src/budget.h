@@ -0,0 +1,38 @@
+#ifndef __budget_h__
+#define __budget_h__
+
+#include <pthread.h>
+#include <stddef.h>
+
+enum scroll_budget_kind {
+	BUDGET_IMAGE = 0,
+	BUDGET_SCALED,
+	BUDGET_CACHE,
+	BUDGET_PIXMAPS,
+	BUDGET_END
+};
+
+/* Memory of the decoded image, the scaled buffers, mapped cache files and the
+ * pixmaps on the server, counted against a single limit */
+struct scroll_budget {
+	/* 0 if unlimited */
+	size_t limit;
+	size_t used[BUDGET_END];
+	size_t peak;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+void scroll_budget_init(struct scroll_budget *budget, size_t limit);
+size_t scroll_budget_parse(const char *str);
+const char *scroll_budget_name(enum scroll_budget_kind kind);
+
+void scroll_budget_add(struct scroll_budget *budget, enum scroll_budget_kind kind, size_t bytes);
+void scroll_budget_sub(struct scroll_budget *budget, enum scroll_budget_kind kind, size_t bytes);
+void scroll_budget_set(struct scroll_budget *budget, enum scroll_budget_kind kind, size_t bytes);
+int scroll_budget_reserve(struct scroll_budget *budget, enum scroll_budget_kind kind, size_t bytes);
+size_t scroll_budget_used(struct scroll_budget *budget);
+size_t scroll_budget_available(struct scroll_budget *budget);
+void scroll_budget_free(struct scroll_budget *budget);
+
+#endif
@@ -0,0 +1,200 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "utils.h"
+
+#define CACHE_MAGIC "SCROLLC1"
+/* Pixel data starts on a page boundary after the header */
+#define CACHE_DATA_OFFSET 4096
+
+struct scroll_cache_header {
+	char magic[8];
+	struct scroll_cache_key key;
+	int32_t source_width, source_height;
+	int32_t width, height, stride;
+};
+
+/* Writes $XDG_CACHE_HOME/scroll to buf, creating it if needed */
+static int cache_dir(char *buf, size_t len) {
+	const char *xdg = getenv("XDG_CACHE_HOME");
+	const char *home = getenv("HOME");
+
+	if (xdg && *xdg) {
+		snprintf(buf, len, "%s", xdg);
+	} else if (home && *home) {
+		snprintf(buf, len, "%s/.cache", home);
+	} else {
+		return 0;
+	}
+
+	if (mkdir(buf, 0700) && errno != EEXIST)
+		return 0;
+
+	strncat(buf, "/scroll", len - strlen(buf) - 1);
+	return !mkdir(buf, 0700) || errno == EEXIST;
+}
+
+static int cache_path(const struct scroll_cache_key *key, char *buf, size_t len) {
+	char dir[PATH_MAX];
+	if (!cache_dir(dir, sizeof(dir)))
+		return 0;
+
+	uint64_t hash = hash_bytes(key, sizeof(struct scroll_cache_key), HASH_INIT);
+	snprintf(buf, len, "%s/%016llx.img", dir, (unsigned long long) hash);
+	return 1;
+}
+
+/* Fills everything except the screen size, returns 0 if the image can't be identified */
+int scroll_cache_key_init(struct scroll_cache_key *key, const char *path, double scale, int scaling_mode,
+	int filter, int linear, int depth, const struct scroll_format *fmt) {
+	char real[PATH_MAX];
+	struct stat st;
+
+	if (!realpath(path, real) || stat(real, &st))
+		return 0;
+
+	memset(key, 0, sizeof(struct scroll_cache_key));
+	key->version = CACHE_VERSION;
+	key->scaling_mode = scaling_mode;
+	key->filter = filter;
+	key->linear = linear;
+	key->path_hash = hash_bytes(real, strlen(real), HASH_INIT);
+	key->mtime_sec = st.st_mtim.tv_sec;
+	key->mtime_nsec = st.st_mtim.tv_nsec;
+	key->size = st.st_size;
+	key->scale = scale;
+	key->depth = depth;
+	memcpy(&key->format, fmt, sizeof(struct scroll_format));
+
+	return 1;
+}
+
+/* Maps the entry for key, returns 0 on a miss */
+int scroll_cache_load(const struct scroll_cache_key *key, struct scroll_cache_entry *entry) {
+	char path[PATH_MAX];
+	struct stat st;
+
+	if (!cache_path(key, path, sizeof(path)))
+		return 0;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	if (fstat(fd, &st) || st.st_size < CACHE_DATA_OFFSET) {
+		close(fd);
+		return 0;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+	/* Mark the entry as recently used */
+	futimens(fd, NULL);
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return 0;
+
+	const struct scroll_cache_header *header = map;
+	if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) ||
+		memcmp(&header->key, key, sizeof(struct scroll_cache_key)) ||
+		st.st_size < CACHE_DATA_OFFSET + (off_t) header->stride * header->height) {
+		_warn("Ignoring invalid cache entry %s", path);
+		munmap(map, st.st_size);
+		return 0;
+	}
+
+	entry->map = map;
+	entry->map_size = st.st_size;
+	entry->source_width = header->source_width;
+	entry->source_height = header->source_height;
+	entry->scaled.width = header->width;
+	entry->scaled.height = header->height;
+	entry->scaled.stride = header->stride;
+	entry->scaled.data = (char *) map + CACHE_DATA_OFFSET;
+
+	return 1;
+}
+
+void scroll_cache_release(struct scroll_cache_entry *entry) {
+	munmap(entry->map, entry->map_size);
+	entry->map = NULL;
+}
+
+static void cache_prune(const char *dir) {
+	DIR *d = opendir(dir);
+	if (!d)
+		return;
+
+	char path[PATH_MAX];
+	struct dirent *ent;
+	struct stat st;
+	time_t now = time(NULL);
+
+	while ((ent = readdir(d))) {
+		if (!strstr(ent->d_name, ".img"))
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+		if (!stat(path, &st) && now - st.st_mtime > CACHE_MAX_AGE) {
+			_debug("Removing stale cache entry %s", path);
+			unlink(path);
+		}
+	}
+
+	closedir(d);
+}
+
+/* Writes an entry atomically, failures only cost the next start a rescale */
+void scroll_cache_store(const struct scroll_cache_key *key, int source_width, int source_height,
+	const struct scroll_scaled *scaled) {
+	char path[PATH_MAX], tmp[PATH_MAX + 16];
+	if (!cache_path(key, path, sizeof(path)))
+		return;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		_warn("Can't write cache entry %s: %s", tmp, strerror(errno));
+		return;
+	}
+
+	char header_buf[CACHE_DATA_OFFSET];
+	struct scroll_cache_header *header = (struct scroll_cache_header *) header_buf;
+	memset(header_buf, 0, sizeof(header_buf));
+	memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+	memcpy(&header->key, key, sizeof(struct scroll_cache_key));
+	header->source_width = source_width;
+	header->source_height = source_height;
+	header->width = scaled->width;
+	header->height = scaled->height;
+	header->stride = scaled->stride;
+
+	size_t size = (size_t) scaled->stride * scaled->height;
+	int ok = write(fd, header_buf, sizeof(header_buf)) == sizeof(header_buf);
+	for (size_t done = 0; ok && done < size;) {
+		ssize_t n = write(fd, scaled->data + done, size - done);
+		if (n > 0)
+			done += n;
+		else
+			ok = 0;
+	}
+
+	if (close(fd) || !ok || rename(tmp, path)) {
+		_warn("Can't write cache entry %s", path);
+		unlink(tmp);
+		return;
+	}
+
+	*strrchr(path, '/') = '\0';
+	cache_prune(path);
+}
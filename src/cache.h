@@ -0,0 +1,44 @@
+#ifndef __cache_h__
+#define __cache_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "scale.h"
+
+/* Bump when the scaler output changes so old entries are ignored */
+#define CACHE_VERSION 4
+/* Entries which haven't been used for this long are removed */
+#define CACHE_MAX_AGE (30 * 24 * 60 * 60)
+
+/* Everything the scaled pixels depend on, padding is zeroed so it can be hashed */
+struct scroll_cache_key {
+	int32_t version;
+	int32_t scaling_mode;
+	int32_t filter;
+	int32_t linear;
+	uint64_t path_hash;
+	int64_t mtime_sec, mtime_nsec;
+	int64_t size;
+	double scale;
+	int32_t screen_width, screen_height;
+	int32_t depth;
+	struct scroll_format format;
+};
+
+/* A cache file mapped into memory */
+struct scroll_cache_entry {
+	void *map;
+	size_t map_size;
+	int source_width, source_height;
+	struct scroll_scaled scaled;
+};
+
+int scroll_cache_key_init(struct scroll_cache_key *key, const char *path, double scale, int scaling_mode,
+	int filter, int linear, int depth, const struct scroll_format *fmt);
+int scroll_cache_load(const struct scroll_cache_key *key, struct scroll_cache_entry *entry);
+void scroll_cache_store(const struct scroll_cache_key *key, int source_width, int source_height,
+	const struct scroll_scaled *scaled);
+void scroll_cache_release(struct scroll_cache_entry *entry);
+
+#endif
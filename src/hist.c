@@ -0,0 +1,47 @@
+#include <string.h>
+
+#include "hist.h"
+#include "utils.h"
+
+void scroll_hist_reset(struct scroll_hist *hist) {
+	memset(hist, 0, sizeof(struct scroll_hist));
+}
+
+static int bucket(uint64_t value) {
+	if (value < HIST_SUB)
+		return value;
+	if (value >> HIST_MAX_BITS)
+		return HIST_BUCKETS - 1;
+
+	int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	return (shift + 1) * HIST_SUB + (value >> shift) - HIST_SUB;
+}
+
+/* Largest value falling into the bucket */
+static uint64_t bucket_max(int index) {
+	if (index < HIST_SUB)
+		return index;
+
+	int shift = index / HIST_SUB - 1;
+	return ((uint64_t) (HIST_SUB + index % HIST_SUB) << shift) + ((uint64_t) 1 << shift) - 1;
+}
+
+void scroll_hist_add(struct scroll_hist *hist, uint64_t value) {
+	++hist->counts[bucket(value)];
+	++hist->total;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+/* Upper bound of the value below which the given percentage of values lies */
+uint64_t scroll_hist_percentile(const struct scroll_hist *hist, double percentile) {
+	uint64_t rank = hist->total * percentile / 100, seen = 0;
+
+	for (int i = 0; i < HIST_BUCKETS; ++i) {
+		seen += hist->counts[i];
+		if (seen > rank || (seen == hist->total && seen))
+			return i == HIST_BUCKETS - 1 ? hist->max : MIN(bucket_max(i), hist->max);
+	}
+
+	return 0;
+}
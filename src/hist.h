@@ -0,0 +1,24 @@
+#ifndef __hist_h__
+#define __hist_h__
+
+#include <stdint.h>
+
+/* Values below HIST_SUB get a bucket each, every power of two above is split into
+ * HIST_SUB buckets, so a bucket is at most 1/16 of its value wide. Up to 2^32. */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 32
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* Log-linear histogram with fixed memory, adding never allocates */
+struct scroll_hist {
+	uint32_t counts[HIST_BUCKETS];
+	uint64_t total;
+	uint64_t max;
+};
+
+void scroll_hist_reset(struct scroll_hist *hist);
+void scroll_hist_add(struct scroll_hist *hist, uint64_t value);
+uint64_t scroll_hist_percentile(const struct scroll_hist *hist, double percentile);
+
+#endif
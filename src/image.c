@@ -0,0 +1,185 @@
+#include <limits.h>
+#include <string.h>
+
+#include "image.h"
+#ifdef JPEG
+#include "jpeg.h"
+#endif
+#ifdef PNG
+#include "png.h"
+#endif
+#include "perf.h"
+#include "probes.h"
+#include "prof.h"
+#include "trace.h"
+#include "utils.h"
+
+static struct scroll_loader *active_loader;
+
+/* Returning 0 makes Imlib abort the load */
+static int scroll_loader_progress(Imlib_Image im, char percent, int x, int y, int w, int h) {
+	return !scroll_loader_cancelled(active_loader);
+}
+
+/* Timing and instrumentation of a finished load, whichever decoder did it */
+static void scroll_loader_done(struct scroll_loader *loader, int start, int64_t trace, struct scroll_perf_sample *perf) {
+	loader->millis = millis() - start;
+	scroll_trace_span("decode", trace, scroll_trace_now(), -1);
+	scroll_perf_end(perf, PERF_DECODE);
+	PROBE4(image_load_end, loader->ok, loader->image->width, loader->image->height, loader->millis);
+}
+
+/* Imlib isn't thread safe, the caller must not use it until the loader has been waited for */
+static void *scroll_loader_thread(void *data) {
+	struct scroll_loader *loader = data;
+	scroll_prof_thread();
+	struct scroll_image *image = loader->image;
+	int start = millis();
+	int64_t trace = scroll_trace_now();
+	struct scroll_perf_sample perf;
+	scroll_perf_begin(&perf);
+	PROBE1(image_load_begin, loader->path);
+
+#ifdef JPEG
+	if (scroll_jpeg_load(loader)) {
+		scroll_loader_done(loader, start, trace, &perf);
+		return NULL;
+	}
+#endif
+
+#ifdef PNG
+	if (scroll_png_load(loader)) {
+		scroll_loader_done(loader, start, trace, &perf);
+		return NULL;
+	}
+#endif
+
+	image->handle = imlib_load_image_immediately(loader->path);
+	if (image->handle && scroll_loader_cancelled(loader)) {
+		imlib_context_set_image(image->handle);
+		imlib_free_image();
+		image->handle = NULL;
+	}
+
+	if (image->handle) {
+		imlib_context_set_image(image->handle);
+		image->width = imlib_image_get_width();
+		image->height = imlib_image_get_height();
+		image->full_width = image->width;
+		image->full_height = image->height;
+		image->pixels = (uint32_t *) imlib_image_get_data_for_reading_only();
+		loader->ok = 1;
+	}
+
+	scroll_loader_done(loader, start, trace, &perf);
+	return NULL;
+}
+
+void scroll_image_load_async(struct scroll_loader *loader, const char *path, struct scroll_image *image) {
+	loader->path = path;
+	loader->image = image;
+	loader->ok = 0;
+	loader->cancelled = 0;
+	loader->millis = 0;
+	loader->has_target = 0;
+	loader->max_bytes = 0;
+	loader->limited = 0;
+	loader->scale_denom = 1;
+	memset(image, 0, sizeof(struct scroll_image));
+
+	pthread_mutex_init(&loader->lock, NULL);
+	pthread_cond_init(&loader->cond, NULL);
+
+	active_loader = loader;
+	imlib_context_set_progress_function(scroll_loader_progress);
+	imlib_context_set_progress_granularity(10);
+
+	loader->running = !pthread_create(&loader->thread, NULL, scroll_loader_thread, loader);
+	if (!loader->running) {
+		_warn("Failed to start decoder thread, decoding synchronously");
+		loader->has_target = 1;
+		loader->target_width = INT_MAX;
+		loader->target_height = INT_MAX;
+		scroll_loader_thread(loader);
+	}
+}
+
+/* Blocks until the image is decoded, returns 0 if decoding failed */
+int scroll_image_wait(struct scroll_loader *loader) {
+	if (loader->running) {
+		/* Without a target the image is decoded at full size */
+		scroll_image_set_target(loader, INT_MAX, INT_MAX, 0);
+
+		pthread_join(loader->thread, NULL);
+		loader->running = 0;
+
+		pthread_mutex_destroy(&loader->lock);
+		pthread_cond_destroy(&loader->cond);
+	}
+	return loader->ok;
+}
+
+/* Aborts decoding when the image turned out not to be needed */
+void scroll_image_cancel(struct scroll_loader *loader) {
+	if (!loader->running)
+		return;
+
+	pthread_mutex_lock(&loader->lock);
+	__atomic_store_n(&loader->cancelled, 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&loader->cond);
+	pthread_mutex_unlock(&loader->lock);
+}
+
+int scroll_loader_cancelled(struct scroll_loader *loader) {
+	return __atomic_load_n(&loader->cancelled, __ATOMIC_RELAXED);
+}
+
+/* Only the first target counts, later screens are handled by reloading */
+void scroll_image_set_target(struct scroll_loader *loader, int width, int height, size_t max_bytes) {
+	if (!loader->running)
+		return;
+
+	pthread_mutex_lock(&loader->lock);
+	if (!loader->has_target) {
+		loader->target_width = width;
+		loader->target_height = height;
+		loader->max_bytes = max_bytes;
+		loader->has_target = 1;
+		pthread_cond_signal(&loader->cond);
+	}
+	pthread_mutex_unlock(&loader->lock);
+}
+
+/* Called by decoders after reading the header, returns 0 if loading was cancelled meanwhile */
+int scroll_loader_target(struct scroll_loader *loader, int *width, int *height, size_t *max_bytes) {
+	pthread_mutex_lock(&loader->lock);
+	while (!loader->has_target && !scroll_loader_cancelled(loader))
+		pthread_cond_wait(&loader->cond, &loader->lock);
+
+	*width = loader->target_width;
+	*height = loader->target_height;
+	*max_bytes = loader->max_bytes;
+	pthread_mutex_unlock(&loader->lock);
+
+	return !scroll_loader_cancelled(loader);
+}
+
+/* Quickly decodes a low resolution version on the calling thread, returns 0 if the format has none */
+int scroll_image_preview(const char *path, struct scroll_image *image) {
+	memset(image, 0, sizeof(struct scroll_image));
+#ifdef JPEG
+	return scroll_jpeg_preview(path, image);
+#else
+	return 0;
+#endif
+}
+
+void scroll_image_free(struct scroll_image *image) {
+	if (image->handle) {
+		imlib_context_set_image(image->handle);
+		imlib_free_image();
+	} else {
+		free(image->pixels);
+	}
+	memset(image, 0, sizeof(struct scroll_image));
+}
@@ -0,0 +1,51 @@
+#ifndef __image_h__
+#define __image_h__
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <Imlib2.h>
+
+/* Decoded source image with ARGB pixels in host byte order, which may be
+ * smaller than the image file if the decoder could scale it down cheaply */
+struct scroll_image {
+	int width, height;
+	int full_width, full_height;
+	uint32_t *pixels;
+	Imlib_Image handle;
+};
+
+/* Decodes an image on a worker thread */
+struct scroll_loader {
+	pthread_t thread;
+	const char *path;
+	struct scroll_image *image;
+	int running;
+	int cancelled;
+	int ok;
+	int millis;
+
+	/* Smallest size the decoded image has to cover, set once the screens are known */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int has_target;
+	int target_width, target_height;
+	/* Decoders which can scale stay below this even if the image no longer covers the target, 0 if unlimited */
+	size_t max_bytes;
+	/* Set by the caller, decoders which can't scale wait for the target to check max_bytes */
+	int budgeted;
+	int limited;
+	int scale_denom;
+};
+
+void scroll_image_load_async(struct scroll_loader *loader, const char *path, struct scroll_image *image);
+int scroll_image_wait(struct scroll_loader *loader);
+void scroll_image_cancel(struct scroll_loader *loader);
+void scroll_image_set_target(struct scroll_loader *loader, int width, int height, size_t max_bytes);
+int scroll_loader_target(struct scroll_loader *loader, int *width, int *height, size_t *max_bytes);
+int scroll_loader_cancelled(struct scroll_loader *loader);
+int scroll_image_preview(const char *path, struct scroll_image *image);
+void scroll_image_free(struct scroll_image *image);
+
+#endif
@@ -0,0 +1,604 @@
+#ifdef JPEG
+
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <jpeglib.h>
+
+#include "jpeg.h"
+#include "perf.h"
+#include "prof.h"
+#include "utils.h"
+
+/* Smaller images decode fast enough on a single thread */
+#define JPEG_STRIP_MIN_PIXELS (16 * 1000 * 1000)
+#define JPEG_MAX_STRIPS 16
+
+struct scroll_jpeg_error {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jmp;
+};
+
+/* Restart intervals of a single scan JPEG, grouped into units which start on an MCU row */
+struct scroll_jpeg_layout {
+	size_t sof;
+	size_t header_size;
+	int width, height;
+	int num_segments;
+	int unit_segments, unit_rows;
+	/* Start of each segment, the last entry points behind EOI */
+	size_t *starts;
+};
+
+/* Rows [y0, y1) of the image. Segments [first, last) also cover a unit above and below,
+ * so chroma upsampling sees the same neighbours as in a sequential decode. */
+struct scroll_jpeg_strip {
+	pthread_t thread;
+	struct scroll_loader *loader;
+	const struct scroll_jpeg_layout *layout;
+	const unsigned char *data;
+	int first, last;
+	int top, bottom;
+	int y0, y1;
+	int denom;
+	uint32_t *pixels;
+	int width, height;
+	int ok;
+};
+
+static void scroll_jpeg_error_exit(j_common_ptr cinfo) {
+	longjmp(((struct scroll_jpeg_error *) cinfo->err)->jmp, 1);
+}
+
+static void scroll_jpeg_message(j_common_ptr cinfo) {
+	char buf[JMSG_LENGTH_MAX];
+	cinfo->err->format_message(cinfo, buf);
+	_debug("libjpeg: %s", buf);
+}
+
+static void scroll_jpeg_init_error(struct jpeg_decompress_struct *cinfo, struct scroll_jpeg_error *err) {
+	cinfo->err = jpeg_std_error(&err->mgr);
+	err->mgr.error_exit = scroll_jpeg_error_exit;
+	err->mgr.output_message = scroll_jpeg_message;
+}
+
+/* Largest 1/2, 1/4 or 1/8 DCT scale which still covers the target size */
+static int scroll_jpeg_denom(int width, int height, int target_width, int target_height) {
+	int denom = 8;
+	while (denom > 1 && ((width + denom - 1) / denom < target_width ||
+		(height + denom - 1) / denom < target_height))
+		denom /= 2;
+	return denom;
+}
+
+static int be16(const unsigned char *p) {
+	return p[0] << 8 | p[1];
+}
+
+static int gcd(int a, int b) {
+	while (b) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Finds the restart segments of a baseline JPEG, returns 0 if it can't be split into strips */
+static int scroll_jpeg_scan(const unsigned char *data, size_t size, struct scroll_jpeg_layout *layout) {
+	size_t pos = 2, sof = 0, sos = 0;
+	int interval = 0;
+
+	while (!sos) {
+		if (pos + 4 > size || data[pos] != 0xff)
+			return 0;
+
+		int marker = data[pos + 1];
+		if (marker == 0xff) {
+			pos++;
+			continue;
+		}
+
+		size_t len = be16(data + pos + 2);
+		if (len < 2 || pos + 2 + len > size)
+			return 0;
+
+		if (marker == 0xc0 || marker == 0xc1) {
+			sof = pos;
+		} else if (marker >= 0xc2 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+			/* Progressive, lossless or arithmetic coded */
+			return 0;
+		} else if (marker == 0xdd && len >= 4) {
+			interval = be16(data + pos + 4);
+		} else if (marker == 0xda) {
+			sos = pos;
+		}
+		pos += 2 + len;
+	}
+
+	if (!sof || !interval || sof + 10 > size)
+		return 0;
+
+	int height = be16(data + sof + 5);
+	int width = be16(data + sof + 7);
+	int num_components = data[sof + 9];
+	if (!width || !height || sof + 10 + 3 * num_components > size || data[sos + 4] != num_components)
+		return 0;
+
+	/* Single component scans aren't interleaved and use 8x8 MCUs */
+	int mcu_width = 8, mcu_height = 8;
+	if (num_components > 1) {
+		for (int i = 0; i < num_components; i++) {
+			int sampling = data[sof + 11 + 3 * i];
+			mcu_width = MAX(mcu_width, 8 * (sampling >> 4));
+			mcu_height = MAX(mcu_height, 8 * (sampling & 15));
+		}
+	}
+
+	int mcus_per_row = (width + mcu_width - 1) / mcu_width;
+	int mcu_rows = (height + mcu_height - 1) / mcu_height;
+	int num_segments = ((long) mcus_per_row * mcu_rows + interval - 1) / interval;
+	long lcm = (long) mcus_per_row / gcd(mcus_per_row, interval) * interval;
+
+	size_t *starts = malloc(sizeof(size_t) * (num_segments + 1));
+	_check_or_die(starts, "Failed to allocate %d JPEG segments", num_segments);
+
+	int n = 0;
+	starts[n++] = pos;
+
+	const unsigned char *p = data + pos, *end = data + size - 1;
+	while ((p = memchr(p, 0xff, end - p))) {
+		int marker = p[1];
+		if (marker == 0x00 || marker == 0xff) {
+			p++;
+		} else if (marker >= 0xd0 && marker <= 0xd7 && n < num_segments) {
+			starts[n++] = p + 2 - data;
+			p += 2;
+		} else if (marker == 0xd9 && n == num_segments) {
+			starts[n] = p + 2 - data;
+			break;
+		} else {
+			/* More scans, DNL or a segment count not matching the header */
+			break;
+		}
+	}
+
+	if (!p || p[1] != 0xd9) {
+		free(starts);
+		return 0;
+	}
+
+	layout->sof = sof;
+	layout->header_size = pos;
+	layout->width = width;
+	layout->height = height;
+	layout->num_segments = num_segments;
+	layout->unit_segments = lcm / interval;
+	layout->unit_rows = lcm / mcus_per_row * mcu_height;
+	layout->starts = starts;
+
+	return 1;
+}
+
+/* Decodes a strip as a JPEG of its own, made of the original header with the strip
+ * height patched in and the strip's segments with renumbered restart markers */
+static void *scroll_jpeg_strip_thread(void *data) {
+	struct scroll_jpeg_strip *strip = data;
+	scroll_prof_thread();
+	const struct scroll_jpeg_layout *layout = strip->layout;
+	size_t body = layout->starts[strip->last] - 2 - layout->starts[strip->first];
+	size_t size = layout->header_size + body + 2;
+	struct scroll_perf_sample perf;
+	scroll_perf_begin(&perf);
+
+	unsigned char *buf = malloc(size);
+	_check_or_die(buf, "Failed to allocate %zu byte JPEG strip", size);
+
+	memcpy(buf, strip->data, layout->header_size);
+	buf[layout->sof + 5] = (strip->bottom - strip->top) >> 8;
+	buf[layout->sof + 6] = (strip->bottom - strip->top) & 0xff;
+
+	unsigned char *seg = buf + layout->header_size;
+	memcpy(seg, strip->data + layout->starts[strip->first], body);
+	for (int i = strip->first + 1; i < strip->last; i++)
+		seg[layout->starts[i] - 1 - layout->starts[strip->first]] = 0xd0 + (i - strip->first - 1) % 8;
+	buf[size - 2] = 0xff;
+	buf[size - 1] = 0xd9;
+
+	/* Receives the context rows above the strip */
+	JSAMPROW scratch = malloc(sizeof(uint32_t) * strip->width);
+	_check_or_die(scratch, "Failed to allocate JPEG row");
+
+	struct jpeg_decompress_struct cinfo;
+	struct scroll_jpeg_error err;
+	scroll_jpeg_init_error(&cinfo, &err);
+
+	if (setjmp(err.jmp)) {
+		jpeg_destroy_decompress(&cinfo);
+		free(scratch);
+		free(buf);
+		return NULL;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, buf, size);
+	jpeg_read_header(&cinfo, TRUE);
+
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = strip->denom;
+	cinfo.out_color_space = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? JCS_EXT_BGRA : JCS_EXT_ARGB;
+	jpeg_start_decompress(&cinfo);
+
+	/* Output rows, the last strip may end in a partial row */
+	int offset = strip->top / strip->denom;
+	int start = strip->y0 / strip->denom - offset;
+	int end = (strip->y1 == layout->height ? strip->height : strip->y1 / strip->denom) - offset;
+
+	if (cinfo.output_width == (unsigned) strip->width && end <= (int) cinfo.output_height) {
+		while (cinfo.output_scanline < (unsigned) end && !scroll_loader_cancelled(strip->loader)) {
+			int y = cinfo.output_scanline;
+			JSAMPROW row = y < start ? scratch : (JSAMPROW) (strip->pixels + (size_t) (offset + y) * strip->width);
+			jpeg_read_scanlines(&cinfo, &row, 1);
+		}
+
+		/* libjpeg resynchronizes on broken restart markers with a warning, which would leave garbage */
+		strip->ok = cinfo.output_scanline == (unsigned) end && !err.mgr.num_warnings;
+	}
+
+	jpeg_destroy_decompress(&cinfo);
+	free(scratch);
+	free(buf);
+	scroll_perf_end(&perf, PERF_DECODE);
+	return NULL;
+}
+
+/* Decodes horizontal strips on a thread each, returns 0 if the image has to be decoded sequentially */
+static int scroll_jpeg_decode_strips(struct scroll_loader *loader, const unsigned char *data, size_t size,
+	int denom, uint32_t *pixels, int width, int height) {
+	struct scroll_jpeg_layout layout;
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (threads < 2 || !scroll_jpeg_scan(data, size, &layout))
+		return 0;
+
+	int num_units = (layout.num_segments + layout.unit_segments - 1) / layout.unit_segments;
+	int num_strips = MIN(MIN(threads, num_units), JPEG_MAX_STRIPS);
+	if (num_strips < 2) {
+		free(layout.starts);
+		return 0;
+	}
+
+	struct scroll_jpeg_strip strips[JPEG_MAX_STRIPS];
+	int started = 0;
+
+	for (int i = 0; i < num_strips; i++) {
+		struct scroll_jpeg_strip *strip = &strips[i];
+		int u0 = (long) num_units * i / num_strips;
+		int u1 = (long) num_units * (i + 1) / num_strips;
+
+		strip->loader = loader;
+		strip->layout = &layout;
+		strip->data = data;
+		strip->y0 = u0 * layout.unit_rows;
+		strip->y1 = MIN(u1 * layout.unit_rows, layout.height);
+		u0 = MAX(u0 - 1, 0);
+		u1 = MIN(u1 + 1, num_units);
+		strip->first = u0 * layout.unit_segments;
+		strip->last = MIN(u1 * layout.unit_segments, layout.num_segments);
+		strip->top = u0 * layout.unit_rows;
+		strip->bottom = MIN(u1 * layout.unit_rows, layout.height);
+		strip->denom = denom;
+		strip->pixels = pixels;
+		strip->width = width;
+		strip->height = height;
+		strip->ok = 0;
+
+		if (pthread_create(&strip->thread, NULL, scroll_jpeg_strip_thread, strip))
+			break;
+		started++;
+	}
+
+	int ok = started == num_strips;
+	for (int i = 0; i < started; i++) {
+		pthread_join(strips[i].thread, NULL);
+		ok = ok && strips[i].ok;
+	}
+
+	if (ok)
+		_debug("Decoded JPEG in %d strips of %d rows", num_strips, layout.height / num_strips);
+	else if (!scroll_loader_cancelled(loader))
+		_warn("Failed to decode JPEG in strips, decoding sequentially");
+
+	free(layout.starts);
+	return ok;
+}
+
+static int scroll_jpeg_decode(struct scroll_loader *loader, const unsigned char *data, size_t size) {
+	struct scroll_image *image = loader->image;
+	struct jpeg_decompress_struct cinfo;
+	struct scroll_jpeg_error err;
+	uint32_t *volatile pixels = NULL;
+
+	scroll_jpeg_init_error(&cinfo, &err);
+
+	if (setjmp(err.jmp)) {
+		_warn("Failed to decode JPEG, falling back to Imlib");
+		jpeg_destroy_decompress(&cinfo);
+		free(pixels);
+		return 0;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, (unsigned char *) data, size);
+	jpeg_read_header(&cinfo, TRUE);
+
+	/* Imlib knows how to convert these */
+	if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK) {
+		jpeg_destroy_decompress(&cinfo);
+		return 0;
+	}
+
+	int target_width, target_height;
+	size_t max_bytes;
+	if (!scroll_loader_target(loader, &target_width, &target_height, &max_bytes)) {
+		jpeg_destroy_decompress(&cinfo);
+		return 1;
+	}
+
+	int denom = scroll_jpeg_denom(cinfo.image_width, cinfo.image_height, target_width, target_height);
+
+	/* Rather decode at a lower resolution than exceed the memory budget */
+	while (max_bytes && denom < 8 && sizeof(uint32_t) * ((cinfo.image_width + denom - 1) / denom) *
+		((cinfo.image_height + denom - 1) / denom) > max_bytes) {
+		denom *= 2;
+		loader->limited = 1;
+	}
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = denom;
+	cinfo.out_color_space = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? JCS_EXT_BGRA : JCS_EXT_ARGB;
+	jpeg_calc_output_dimensions(&cinfo);
+
+	int width = cinfo.output_width;
+	int height = cinfo.output_height;
+	pixels = malloc(sizeof(uint32_t) * width * height);
+	_check_or_die(pixels, "Failed to allocate %dx%d image", width, height);
+
+	int done = (long) cinfo.image_width * cinfo.image_height >= JPEG_STRIP_MIN_PIXELS &&
+		scroll_jpeg_decode_strips(loader, data, size, denom, pixels, width, height);
+
+	if (!done) {
+		jpeg_start_decompress(&cinfo);
+
+		while (cinfo.output_scanline < cinfo.output_height && !scroll_loader_cancelled(loader)) {
+			JSAMPROW row = (JSAMPROW) (pixels + (size_t) cinfo.output_scanline * width);
+			jpeg_read_scanlines(&cinfo, &row, 1);
+		}
+
+		if (!scroll_loader_cancelled(loader))
+			jpeg_finish_decompress(&cinfo);
+	}
+
+	if (scroll_loader_cancelled(loader)) {
+		jpeg_destroy_decompress(&cinfo);
+		free(pixels);
+		return 1;
+	}
+
+	_debug("Decoded %dx%d JPEG at 1/%d scale", cinfo.image_width, cinfo.image_height, denom);
+
+	image->width = width;
+	image->height = height;
+	image->full_width = cinfo.image_width;
+	image->full_height = cinfo.image_height;
+	image->pixels = pixels;
+	image->handle = NULL;
+	loader->scale_denom = denom;
+	loader->ok = 1;
+
+	jpeg_destroy_decompress(&cinfo);
+	return 1;
+}
+
+/* Reads a 16 or 32 bit TIFF value in the byte order of the Exif block */
+static uint32_t tiff_read(const unsigned char *p, int bytes, int big_endian) {
+	uint32_t v = 0;
+	for (int i = 0; i < bytes; i++)
+		v |= (uint32_t) p[big_endian ? i : bytes - 1 - i] << (8 * (bytes - 1 - i));
+	return v;
+}
+
+/* Finds the JPEG thumbnail in IFD1 of an Exif APP1 segment */
+static int scroll_jpeg_thumbnail(const unsigned char *data, size_t size, const unsigned char **thumb, size_t *thumb_size) {
+	size_t pos = 2;
+
+	for (; pos + 4 <= size && data[pos] == 0xff && data[pos + 1] != 0xda; pos += 2 + be16(data + pos + 2)) {
+		size_t len = be16(data + pos + 2);
+		const unsigned char *tiff = data + pos + 10;
+		size_t tiff_len = len - 8;
+
+		if (len < 2 || pos + 2 + len > size)
+			return 0;
+
+		if (data[pos + 1] != 0xe1 || len < 8 + 8 || memcmp(data + pos + 4, "Exif\0\0", 6))
+			continue;
+
+		int big_endian = tiff[0] == 'M';
+		/* Offsets come from the file, size_t keeps the checks from wrapping */
+		size_t ifd = tiff_read(tiff + 4, 4, big_endian);
+		if (ifd + 2 > tiff_len)
+			return 0;
+
+		/* Skip IFD0 to get to the thumbnail's IFD1 */
+		size_t entries = tiff_read(tiff + ifd, 2, big_endian);
+		if (ifd + 2 + 12 * entries + 4 > tiff_len)
+			return 0;
+		ifd = tiff_read(tiff + ifd + 2 + 12 * entries, 4, big_endian);
+		if (!ifd || ifd + 2 > tiff_len)
+			return 0;
+
+		entries = tiff_read(tiff + ifd, 2, big_endian);
+		size_t offset = 0, length = 0;
+		for (size_t i = 0; i < entries && ifd + 2 + 12 * (i + 1) <= tiff_len; i++) {
+			const unsigned char *entry = tiff + ifd + 2 + 12 * i;
+			int tag = tiff_read(entry, 2, big_endian);
+			if (tag == 0x0201)
+				offset = tiff_read(entry + 8, 4, big_endian);
+			else if (tag == 0x0202)
+				length = tiff_read(entry + 8, 4, big_endian);
+		}
+
+		if (length < 2 || offset > tiff_len || length > tiff_len - offset || tiff[offset] != 0xff || tiff[offset + 1] != 0xd8)
+			return 0;
+
+		*thumb = tiff + offset;
+		*thumb_size = length;
+		return 1;
+	}
+
+	return 0;
+}
+
+/* Reads the image size from the SOF marker */
+static int scroll_jpeg_size(const unsigned char *data, size_t size, int *width, int *height) {
+	size_t pos = 2;
+
+	for (; pos + 9 <= size && data[pos] == 0xff; pos += 2 + be16(data + pos + 2)) {
+		int marker = data[pos + 1];
+		if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+			*height = be16(data + pos + 5);
+			*width = be16(data + pos + 7);
+			return *width && *height;
+		}
+	}
+	return 0;
+}
+
+/* Decodes data at 1/denom scale without a loader, returns 0 on errors */
+static int scroll_jpeg_decode_simple(const unsigned char *data, size_t size, int denom, struct scroll_image *image) {
+	struct jpeg_decompress_struct cinfo;
+	struct scroll_jpeg_error err;
+	uint32_t *volatile pixels = NULL;
+
+	scroll_jpeg_init_error(&cinfo, &err);
+
+	if (setjmp(err.jmp)) {
+		jpeg_destroy_decompress(&cinfo);
+		free(pixels);
+		return 0;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, (unsigned char *) data, size);
+	jpeg_read_header(&cinfo, TRUE);
+
+	if (cinfo.jpeg_color_space == JCS_CMYK || cinfo.jpeg_color_space == JCS_YCCK) {
+		jpeg_destroy_decompress(&cinfo);
+		return 0;
+	}
+
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = denom;
+	cinfo.out_color_space = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? JCS_EXT_BGRA : JCS_EXT_ARGB;
+	/* Only used for previews, speed over quality */
+	cinfo.dct_method = JDCT_IFAST;
+	cinfo.do_fancy_upsampling = FALSE;
+	jpeg_start_decompress(&cinfo);
+
+	int width = cinfo.output_width;
+	pixels = malloc(sizeof(uint32_t) * width * cinfo.output_height);
+	_check_or_die(pixels, "Failed to allocate %dx%d image", width, cinfo.output_height);
+
+	while (cinfo.output_scanline < cinfo.output_height) {
+		JSAMPROW row = (JSAMPROW) (pixels + (size_t) cinfo.output_scanline * width);
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+
+	image->width = width;
+	image->height = cinfo.output_height;
+	image->full_width = cinfo.image_width;
+	image->full_height = cinfo.image_height;
+	image->pixels = pixels;
+	image->handle = NULL;
+
+	jpeg_destroy_decompress(&cinfo);
+	return 1;
+}
+
+/* Decodes a low resolution version of the image for showing something while the real decode
+ * runs: the Exif thumbnail if it has the image's aspect ratio, otherwise the image at 1/8 scale */
+int scroll_jpeg_preview(const char *path, struct scroll_image *image) {
+	struct stat st;
+	const unsigned char *thumb;
+	size_t thumb_size;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	if (fstat(fd, &st) || st.st_size < 4) {
+		close(fd);
+		return 0;
+	}
+
+	unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return 0;
+
+	int ok = data[0] == 0xff && data[1] == 0xd8 && data[2] == 0xff;
+	if (ok && scroll_jpeg_thumbnail(data, st.st_size, &thumb, &thumb_size) &&
+		scroll_jpeg_decode_simple(thumb, thumb_size, 1, image)) {
+		/* Thumbnails of other aspect ratios are letterboxed */
+		int width, height;
+		if (scroll_jpeg_size(data, st.st_size, &width, &height) &&
+			fabs((double) image->width * height / (image->height * width) - 1) < 0.02) {
+			image->full_width = width;
+			image->full_height = height;
+			munmap(data, st.st_size);
+			return 1;
+		}
+
+		scroll_image_free(image);
+	}
+
+	ok = ok && scroll_jpeg_decode_simple(data, st.st_size, 8, image);
+	munmap(data, st.st_size);
+	return ok;
+}
+
+/* Decodes JPEGs directly with libjpeg, letting the IDCT do the bulk of the downscaling.
+ * Returns 0 if the file should be loaded by Imlib instead. */
+int scroll_jpeg_load(struct scroll_loader *loader) {
+	struct stat st;
+
+	int fd = open(loader->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	if (fstat(fd, &st) || st.st_size < 4) {
+		close(fd);
+		return 0;
+	}
+
+	unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return 0;
+
+	int ret = 0;
+	if (data[0] == 0xff && data[1] == 0xd8 && data[2] == 0xff)
+		ret = scroll_jpeg_decode(loader, data, st.st_size);
+
+	munmap(data, st.st_size);
+	return ret;
+}
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef __jpeg_h__
+#define __jpeg_h__
+
+#include "image.h"
+
+int scroll_jpeg_load(struct scroll_loader *loader);
+int scroll_jpeg_preview(const char *path, struct scroll_image *image);
+
+#endif
@@ -0,0 +1,668 @@
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "log.h"
+#include "utils.h"
+
+#define LOG_LINE 1024
+#define JOURNAL_SOCKET "/run/systemd/journal/socket"
+
+enum {
+	RING_FREE = 0,
+	RING_USED,
+	/* The thread exited, the ring is free once flushed */
+	RING_EXITED
+};
+
+/* What a conversion takes from the arguments */
+enum {
+	ARG_NONE = 0,
+	ARG_INT,
+	ARG_UINT,
+	ARG_DOUBLE,
+	ARG_LDOUBLE,
+	ARG_STRING,
+	ARG_POINTER
+};
+
+/* The format stays a pointer, the arguments are copied in the order they are
+ * formatted: integers widened to 64 bits, doubles, and strings with their length */
+struct scroll_log_record {
+	uint64_t seq;
+	struct scroll_log_site *site;
+	const char *fmt;
+	uint32_t suppressed;
+	uint32_t size;
+	/* Arguments didn't fit, the message ends early */
+	int cut;
+	unsigned char args[LOG_ARGS_SIZE] __attribute__((aligned(16)));
+};
+
+/* Written by its thread only, head and tail are the only shared state */
+struct scroll_log_ring {
+	struct scroll_log_record records[LOG_RING_RECORDS];
+	uint32_t head;
+	uint32_t tail;
+	int state;
+};
+
+/* One conversion of a format */
+struct scroll_log_spec {
+	const char *start;
+	/* Flags, width and precision */
+	int body;
+	int stars;
+	char length[3];
+	char conv;
+	int type;
+};
+
+static const char *level_prefixes[] = { "ERROR: ", "WARNING: ", "INFO: ", "DEBUG: " };
+/* Syslog priorities */
+static const int level_priorities[] = { 3, 4, 6, 7 };
+
+static struct {
+	struct scroll_log_ring *rings[LOG_MAX_THREADS];
+	uint64_t seq;
+	uint64_t dropped;
+	/* Sites with suppressed messages, pushed by producers and taken by the flush */
+	struct scroll_log_site *pending;
+	/* Held while writing out, producers never take it */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int running;
+	int stop;
+	int journal;
+	pthread_key_t key;
+} logger = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER, .journal = -1 };
+
+static __thread struct scroll_log_ring *thread_ring;
+
+static void scroll_log_thread_exit(void *data) {
+	struct scroll_log_ring *ring = data;
+	__atomic_store_n(&ring->state, RING_EXITED, __ATOMIC_RELEASE);
+}
+
+/* Claims a ring on the thread's first message, allocating it if no exited thread left one */
+static struct scroll_log_ring *scroll_log_ring(void) {
+	if (!logger.running || thread_ring)
+		return logger.running ? thread_ring : NULL;
+
+	for (int i = 0; i < LOG_MAX_THREADS; ++i) {
+		struct scroll_log_ring *ring = __atomic_load_n(&logger.rings[i], __ATOMIC_ACQUIRE);
+
+		if (!ring) {
+			struct scroll_log_ring *fresh = calloc(1, sizeof(struct scroll_log_ring));
+			if (!fresh)
+				return NULL;
+
+			fresh->state = RING_USED;
+			if (!__atomic_compare_exchange_n(&logger.rings[i], &ring, fresh, 0,
+				__ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+				free(fresh);
+				continue;
+			}
+			ring = fresh;
+		} else {
+			int state = RING_FREE;
+			if (!__atomic_compare_exchange_n(&ring->state, &state, RING_USED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				continue;
+		}
+
+		pthread_setspecific(logger.key, ring);
+		thread_ring = ring;
+		return ring;
+	}
+
+	return NULL;
+}
+
+/* Parses the conversion after a '%', returns the position after it */
+static const char *scroll_log_spec(const char *p, struct scroll_log_spec *spec) {
+	memset(spec, 0, sizeof(struct scroll_log_spec));
+	spec->start = p;
+
+	while (*p && strchr("-+ #0", *p))
+		++p;
+	for (int precision = 0; precision < 2; ++precision) {
+		if (precision && *p != '.')
+			break;
+		if (precision)
+			++p;
+
+		if (*p == '*') {
+			++spec->stars;
+			++p;
+		} else {
+			while (*p >= '0' && *p <= '9')
+				++p;
+		}
+	}
+	spec->body = p - spec->start;
+
+	if (*p && strchr("hlzjtL", *p)) {
+		spec->length[0] = *p++;
+		/* hh and ll */
+		if ((spec->length[0] == 'h' || spec->length[0] == 'l') && *p == spec->length[0])
+			spec->length[1] = *p++;
+	}
+
+	spec->conv = *p;
+	if (!*p)
+		return p;
+
+	switch (*p) {
+	case 'd':
+	case 'i':
+	case 'c':
+		spec->type = ARG_INT;
+		break;
+	case 'u':
+	case 'o':
+	case 'x':
+	case 'X':
+		spec->type = ARG_UINT;
+		break;
+	case 'f':
+	case 'F':
+	case 'e':
+	case 'E':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		spec->type = spec->length[0] == 'L' ? ARG_LDOUBLE : ARG_DOUBLE;
+		break;
+	case 's':
+		spec->type = ARG_STRING;
+		break;
+	case 'p':
+	case 'n':
+		spec->type = ARG_POINTER;
+		break;
+	default:
+		spec->type = ARG_NONE;
+		break;
+	}
+
+	return p + 1;
+}
+
+static int scroll_log_put(struct scroll_log_record *record, const void *data, size_t size) {
+	size_t at = (record->size + 7) & ~(size_t) 7;
+	if (record->cut || at + size > LOG_ARGS_SIZE) {
+		record->cut = 1;
+		return 0;
+	}
+
+	memcpy(record->args + at, data, size);
+	record->size = at + size;
+	return 1;
+}
+
+static int scroll_log_get(const struct scroll_log_record *record, size_t *pos, void *data, size_t size) {
+	size_t at = (*pos + 7) & ~(size_t) 7;
+	if (at + size > record->size)
+		return 0;
+
+	memcpy(data, record->args + at, size);
+	*pos = at + size;
+	return 1;
+}
+
+static long long scroll_log_signed(const struct scroll_log_spec *spec, va_list *ap) {
+	switch (spec->length[0]) {
+	case 'h':
+		return spec->length[1] ? (signed char) va_arg(*ap, int) : (short) va_arg(*ap, int);
+	case 'l':
+		return spec->length[1] ? va_arg(*ap, long long) : va_arg(*ap, long);
+	case 'z':
+		return (long long) va_arg(*ap, size_t);
+	case 'j':
+		return va_arg(*ap, intmax_t);
+	case 't':
+		return va_arg(*ap, ptrdiff_t);
+	default:
+		return va_arg(*ap, int);
+	}
+}
+
+static unsigned long long scroll_log_unsigned(const struct scroll_log_spec *spec, va_list *ap) {
+	switch (spec->length[0]) {
+	case 'h':
+		return spec->length[1] ? (unsigned char) va_arg(*ap, unsigned int) : (unsigned short) va_arg(*ap, unsigned int);
+	case 'l':
+		return spec->length[1] ? va_arg(*ap, unsigned long long) : va_arg(*ap, unsigned long);
+	case 'z':
+		return va_arg(*ap, size_t);
+	case 'j':
+		return va_arg(*ap, uintmax_t);
+	case 't':
+		return (unsigned long long) va_arg(*ap, ptrdiff_t);
+	default:
+		return va_arg(*ap, unsigned int);
+	}
+}
+
+/* Copies the arguments the format refers to */
+static void scroll_log_capture(struct scroll_log_record *record, va_list *ap) {
+	struct scroll_log_spec spec;
+
+	for (const char *p = record->fmt; *p; ) {
+		if (*p++ != '%')
+			continue;
+
+		p = scroll_log_spec(p, &spec);
+		for (int i = 0; i < spec.stars; ++i) {
+			long long star = va_arg(*ap, int);
+			scroll_log_put(record, &star, sizeof(star));
+		}
+
+		switch (spec.type) {
+		case ARG_INT: {
+			long long value = scroll_log_signed(&spec, ap);
+			scroll_log_put(record, &value, sizeof(value));
+			break;
+		}
+		case ARG_UINT: {
+			unsigned long long value = scroll_log_unsigned(&spec, ap);
+			scroll_log_put(record, &value, sizeof(value));
+			break;
+		}
+		case ARG_DOUBLE: {
+			double value = va_arg(*ap, double);
+			scroll_log_put(record, &value, sizeof(value));
+			break;
+		}
+		case ARG_LDOUBLE: {
+			long double value = va_arg(*ap, long double);
+			scroll_log_put(record, &value, sizeof(value));
+			break;
+		}
+		case ARG_STRING: {
+			const char *value = va_arg(*ap, const char *);
+			if (!value)
+				value = "(null)";
+
+			/* Cut to what is left, keeping room for the terminator */
+			size_t at = (record->size + 7) & ~(size_t) 7;
+			uint32_t len = strlen(value);
+			if (!record->cut && at + sizeof(len) + 1 < LOG_ARGS_SIZE)
+				len = MIN(len, LOG_ARGS_SIZE - at - sizeof(len) - 1);
+			if (scroll_log_put(record, &len, sizeof(len))) {
+				memcpy(record->args + record->size, value, len);
+				record->args[record->size + len] = '\0';
+				record->size += len + 1;
+			}
+			break;
+		}
+		case ARG_POINTER: {
+			void *value = va_arg(*ap, void *);
+			scroll_log_put(record, &value, sizeof(value));
+			break;
+		}
+		}
+	}
+}
+
+/* Formats a record the way printf would have, returns the length */
+static int scroll_log_format(const struct scroll_log_record *record, char *out, size_t size) {
+	const struct scroll_log_site *site = record->site;
+	struct scroll_log_spec spec;
+	size_t len = 0, pos = 0;
+	char conv[32];
+
+#define LOG_APPEND(N) len = MIN(len + MAX((N), 0), size - 1)
+#define LOG_PRINT(...) LOG_APPEND(spec.stars == 2 ? snprintf(out + len, size - len, conv, stars[0], stars[1], __VA_ARGS__) : \
+	spec.stars == 1 ? snprintf(out + len, size - len, conv, stars[0], __VA_ARGS__) : \
+	snprintf(out + len, size - len, conv, __VA_ARGS__))
+
+	if (site->level == LEVEL_DEBUG)
+		LOG_APPEND(snprintf(out, size, "%s%s:%d ", level_prefixes[site->level], site->file, site->line));
+	else
+		LOG_APPEND(snprintf(out, size, "%s", level_prefixes[site->level]));
+
+	for (const char *p = record->fmt; *p; ) {
+		if (*p != '%') {
+			const char *next = strchr(p, '%');
+			if (!next)
+				next = p + strlen(p);
+			LOG_APPEND(snprintf(out + len, size - len, "%.*s", (int) (next - p), p));
+			p = next;
+			continue;
+		}
+
+		p = scroll_log_spec(p + 1, &spec);
+		if (!spec.conv)
+			break;
+		if (spec.type == ARG_NONE) {
+			LOG_APPEND(snprintf(out + len, size - len, "%c", spec.conv));
+			continue;
+		}
+
+		int stars[2];
+		long long star;
+		int ok = 1;
+		for (int i = 0; i < spec.stars; ++i) {
+			ok = ok && scroll_log_get(record, &pos, &star, sizeof(star));
+			stars[i] = star;
+		}
+
+		/* Same flags, width and precision, with the width of the copied value */
+		const char *length = spec.type == ARG_INT || spec.type == ARG_UINT ? "ll" :
+			spec.type == ARG_LDOUBLE ? "L" : "";
+		snprintf(conv, sizeof(conv), "%%%.*s%s%c", MIN(spec.body, 16), spec.start, length, spec.conv);
+
+		switch (spec.type) {
+		case ARG_INT: {
+			long long value;
+			if ((ok = ok && scroll_log_get(record, &pos, &value, sizeof(value))))
+				LOG_PRINT(value);
+			break;
+		}
+		case ARG_UINT: {
+			unsigned long long value;
+			if ((ok = ok && scroll_log_get(record, &pos, &value, sizeof(value))))
+				LOG_PRINT(value);
+			break;
+		}
+		case ARG_DOUBLE: {
+			double value;
+			if ((ok = ok && scroll_log_get(record, &pos, &value, sizeof(value))))
+				LOG_PRINT(value);
+			break;
+		}
+		case ARG_LDOUBLE: {
+			long double value;
+			if ((ok = ok && scroll_log_get(record, &pos, &value, sizeof(value))))
+				LOG_PRINT(value);
+			break;
+		}
+		case ARG_STRING: {
+			uint32_t n;
+			if ((ok = ok && scroll_log_get(record, &pos, &n, sizeof(n)) && pos + n + 1 <= record->size)) {
+				LOG_PRINT((const char *) record->args + pos);
+				pos += n + 1;
+			}
+			break;
+		}
+		case ARG_POINTER: {
+			void *value;
+			/* %n writes nothing and has nothing to print */
+			if ((ok = ok && scroll_log_get(record, &pos, &value, sizeof(value))) && spec.conv == 'p')
+				LOG_PRINT(value);
+			break;
+		}
+		}
+
+		if (!ok)
+			break;
+	}
+
+	if (record->cut)
+		LOG_APPEND(snprintf(out + len, size - len, " [cut]"));
+	if (record->suppressed)
+		LOG_APPEND(snprintf(out + len, size - len, " (%u more suppressed)", record->suppressed));
+
+#undef LOG_PRINT
+#undef LOG_APPEND
+	return len;
+}
+
+/* Native journal protocol, one datagram of KEY=VALUE lines per message */
+static int scroll_log_journal(const struct scroll_log_site *site, const char *message) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX, .sun_path = JOURNAL_SOCKET };
+	char buf[LOG_LINE + 256];
+	int len = snprintf(buf, sizeof(buf), "PRIORITY=%d\nSYSLOG_IDENTIFIER=scroll\nCODE_FILE=%s\nCODE_LINE=%d\nMESSAGE=",
+		level_priorities[site->level], site->file, site->line);
+
+	/* Without the prefix, the priority says it already */
+	const char *text = message + strlen(level_prefixes[site->level]);
+	for (; *text && len < (int) sizeof(buf) - 1; ++text)
+		buf[len++] = *text == '\n' ? ' ' : *text;
+	buf[len++] = '\n';
+
+	return sendto(logger.journal, buf, len, MSG_NOSIGNAL, (struct sockaddr *) &addr, sizeof(addr)) == len;
+}
+
+/* Line has room for the newline */
+static void scroll_log_output(const struct scroll_log_site *site, char *line, int len) {
+	if (logger.journal >= 0 && scroll_log_journal(site, line))
+		return;
+
+	line[len++] = '\n';
+	fwrite(line, 1, len, stderr);
+}
+
+static void scroll_log_emit(const struct scroll_log_record *record) {
+	char line[LOG_LINE];
+	scroll_log_output(record->site, line, scroll_log_format(record, line, sizeof(line)));
+}
+
+static int64_t scroll_log_millis(void) {
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &spec);
+	return (int64_t) spec.tv_sec * 1000 + spec.tv_nsec / 1000000;
+}
+
+static void scroll_log_queue(struct scroll_log_site *site) {
+	int queued = 0;
+	if (!__atomic_compare_exchange_n(&site->queued, &queued, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return;
+
+	struct scroll_log_site *head = __atomic_load_n(&logger.pending, __ATOMIC_RELAXED);
+	do {
+		site->next = head;
+	} while (!__atomic_compare_exchange_n(&logger.pending, &head, site, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Reports what sites suppressed once their window is over, so the end of a burst isn't lost */
+static void scroll_log_report_suppressed(void) {
+	struct scroll_log_site *site = __atomic_exchange_n(&logger.pending, NULL, __ATOMIC_ACQUIRE);
+	int64_t now = scroll_log_millis();
+
+	while (site) {
+		struct scroll_log_site *next = site->next;
+
+		/* Everything is reported when stopping */
+		if (!logger.stop && now - __atomic_load_n(&site->window, __ATOMIC_RELAXED) < LOG_RATE_MILLIS) {
+			/* Still in its window, the next admitted message may report it instead */
+			__atomic_store_n(&site->queued, 0, __ATOMIC_RELEASE);
+			scroll_log_queue(site);
+		} else {
+			uint32_t suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+			if (suppressed) {
+				char line[LOG_LINE];
+				int len = snprintf(line, sizeof(line) - 1, "%s%s:%d suppressed %u messages like \"%s\"",
+					level_prefixes[site->level], site->file, site->line, suppressed, site->fmt);
+				scroll_log_output(site, line, MIN(len, (int) sizeof(line) - 2));
+			}
+
+			__atomic_store_n(&site->queued, 0, __ATOMIC_RELEASE);
+			/* Suppressed again while it was being reported */
+			if (__atomic_load_n(&site->suppressed, __ATOMIC_RELAXED))
+				scroll_log_queue(site);
+		}
+
+		site = next;
+	}
+}
+
+/* Writes the records of every thread in the order they were logged, with the lock held */
+static void scroll_log_drain(void) {
+	for (;;) {
+		struct scroll_log_ring *next = NULL;
+		uint64_t seq = UINT64_MAX;
+
+		for (int i = 0; i < LOG_MAX_THREADS; ++i) {
+			struct scroll_log_ring *ring = __atomic_load_n(&logger.rings[i], __ATOMIC_ACQUIRE);
+			if (!ring)
+				break;
+
+			if (ring->tail != __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) &&
+				ring->records[ring->tail % LOG_RING_RECORDS].seq < seq) {
+				next = ring;
+				seq = ring->records[ring->tail % LOG_RING_RECORDS].seq;
+			}
+		}
+
+		if (!next)
+			break;
+		scroll_log_emit(&next->records[next->tail % LOG_RING_RECORDS]);
+		__atomic_store_n(&next->tail, next->tail + 1, __ATOMIC_RELEASE);
+	}
+
+	/* Nothing can be added after the thread exited */
+	for (int i = 0; i < LOG_MAX_THREADS; ++i) {
+		struct scroll_log_ring *ring = __atomic_load_n(&logger.rings[i], __ATOMIC_ACQUIRE);
+		if (ring && __atomic_load_n(&ring->state, __ATOMIC_ACQUIRE) == RING_EXITED &&
+			ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+			ring->head = ring->tail = 0;
+			__atomic_store_n(&ring->state, RING_FREE, __ATOMIC_RELEASE);
+		}
+	}
+
+	scroll_log_report_suppressed();
+
+	uint64_t dropped = __atomic_exchange_n(&logger.dropped, 0, __ATOMIC_RELAXED);
+	if (dropped)
+		fprintf(stderr, "WARNING: Dropped %llu log messages, the buffers were full\n", (unsigned long long) dropped);
+	fflush(stderr);
+}
+
+/* Lets LOG_RATE_BURST messages per LOG_RATE_MILLIS through limited sites, racy between threads but never by much */
+static int scroll_log_admit(struct scroll_log_site *site, uint32_t *suppressed) {
+	*suppressed = 0;
+	if (!site->limited)
+		return 1;
+
+	int64_t now = scroll_log_millis();
+
+	if (now - __atomic_load_n(&site->window, __ATOMIC_RELAXED) >= LOG_RATE_MILLIS) {
+		__atomic_store_n(&site->window, now, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+	}
+
+	if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > LOG_RATE_BURST) {
+		__atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+		scroll_log_queue(site);
+		return 0;
+	}
+
+	*suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+	return 1;
+}
+
+void scroll_log_write(struct scroll_log_site *site, const char *fmt, ...) {
+	uint32_t suppressed;
+	if (!scroll_log_admit(site, &suppressed))
+		return;
+
+	struct scroll_log_ring *ring = scroll_log_ring();
+	uint64_t seq = __atomic_fetch_add(&logger.seq, 1, __ATOMIC_RELAXED);
+	va_list ap;
+	va_start(ap, fmt);
+
+	/* Errors often come right before exiting, they are written out at once */
+	if (!ring || site->level == LEVEL_ERROR) {
+		struct scroll_log_record record = { seq, site, fmt, suppressed, 0, 0 };
+		scroll_log_capture(&record, &ap);
+		va_end(ap);
+
+		pthread_mutex_lock(&logger.lock);
+		scroll_log_drain();
+		scroll_log_emit(&record);
+		fflush(stderr);
+		pthread_mutex_unlock(&logger.lock);
+		return;
+	}
+
+	uint32_t head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_RECORDS) {
+		__atomic_add_fetch(&logger.dropped, 1, __ATOMIC_RELAXED);
+		va_end(ap);
+		return;
+	}
+
+	struct scroll_log_record *record = &ring->records[head % LOG_RING_RECORDS];
+	record->seq = seq;
+	record->site = site;
+	record->fmt = fmt;
+	record->suppressed = suppressed;
+	record->size = 0;
+	record->cut = 0;
+	scroll_log_capture(record, &ap);
+	va_end(ap);
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static void *scroll_log_thread(void *data) {
+	pthread_mutex_lock(&logger.lock);
+	while (!logger.stop) {
+		scroll_log_drain();
+
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += LOG_FLUSH_MILLIS * 1000000L;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+		deadline.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&logger.cond, &logger.lock, &deadline);
+	}
+	pthread_mutex_unlock(&logger.lock);
+	return NULL;
+}
+
+/* Until then messages are written right away. Stops on exit. */
+void scroll_log_start(int journal) {
+	if (journal) {
+		logger.journal = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (logger.journal < 0)
+			fprintf(stderr, "WARNING: Can't open journal socket: %s\n", strerror(errno));
+	}
+
+	pthread_key_create(&logger.key, scroll_log_thread_exit);
+
+	/* The thread takes no signals, the loop reads them */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	logger.running = !pthread_create(&logger.thread, NULL, scroll_log_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (logger.running)
+		atexit(scroll_log_stop);
+}
+
+/* Writes out what is buffered, from any thread */
+void scroll_log_flush(void) {
+	pthread_mutex_lock(&logger.lock);
+	scroll_log_drain();
+	pthread_mutex_unlock(&logger.lock);
+}
+
+void scroll_log_stop(void) {
+	if (!logger.running)
+		return;
+
+	pthread_mutex_lock(&logger.lock);
+	logger.stop = 1;
+	pthread_cond_signal(&logger.cond);
+	pthread_mutex_unlock(&logger.lock);
+	pthread_join(logger.thread, NULL);
+	logger.running = 0;
+
+	scroll_log_flush();
+	if (logger.journal >= 0)
+		close(logger.journal);
+	logger.journal = -1;
+}
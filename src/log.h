@@ -0,0 +1,58 @@
+#ifndef __log_h__
+#define __log_h__
+
+#include <stdint.h>
+
+#define LEVEL_ERROR 0
+#define LEVEL_WARN 1
+#define LEVEL_INFO 2
+#define LEVEL_DEBUG 3
+
+/* Messages above it are compiled out */
+#ifndef LOG_LEVEL
+#ifdef DEBUG
+#define LOG_LEVEL LEVEL_DEBUG
+#else
+#define LOG_LEVEL LEVEL_INFO
+#endif
+#endif
+
+#define LOG_MAX_THREADS 32
+#define LOG_RING_RECORDS 128
+/* Arguments of a record, longer strings are cut */
+#define LOG_ARGS_SIZE 192
+#define LOG_FLUSH_MILLIS 50
+/* Messages per rate limited call site and second, the rest are counted and skipped */
+#define LOG_RATE_BURST 10
+#define LOG_RATE_MILLIS 1000
+
+/* One per call site, defined by the logging macros */
+struct scroll_log_site {
+	int level;
+	int limited;
+	const char *file;
+	int line;
+	const char *fmt;
+	int64_t window;
+	uint32_t count;
+	uint32_t suppressed;
+	/* On the logger's list of sites with a suppression count to report */
+	int queued;
+	struct scroll_log_site *next;
+};
+
+void scroll_log_write(struct scroll_log_site *site, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+void scroll_log_start(int journal);
+void scroll_log_flush(void);
+void scroll_log_stop(void);
+
+/* Limited sites let LOG_RATE_BURST messages per LOG_RATE_MILLIS through */
+#define _log_at(L, LIMITED, M, ...) do { \
+	if ((L) <= LOG_LEVEL) { \
+		static struct scroll_log_site _site = { L, LIMITED, __FILE__, __LINE__, M, 0, 0, 0, 0, NULL }; \
+		scroll_log_write(&_site, M, ##__VA_ARGS__); \
+	} \
+} while (0)
+
+#endif
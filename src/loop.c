@@ -0,0 +1,151 @@
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "loop.h"
+#include "utils.h"
+
+void scroll_loop_init(struct scroll_loop *loop) {
+	loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	_check_or_die(loop->epoll_fd >= 0, "Failed to create epoll instance: %s", strerror(errno));
+
+	loop->running = 0;
+
+	for (int i = 0; i < LOOP_MAX_HANDLERS; ++i)
+		loop->handlers[i].fd = -1;
+}
+
+void scroll_loop_add(struct scroll_loop *loop, int fd, scroll_loop_cb cb, void *data) {
+	struct scroll_loop_handler *handler = NULL;
+
+	for (int i = 0; i < LOOP_MAX_HANDLERS; ++i) {
+		if (loop->handlers[i].fd < 0) {
+			handler = &loop->handlers[i];
+			break;
+		}
+	}
+	_check_or_die(handler, "Too many event sources");
+
+	handler->fd = fd;
+	handler->cb = cb;
+	handler->data = data;
+
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = handler };
+	_check_or_die(!epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev),
+		"Failed to watch fd %d: %s", fd, strerror(errno));
+}
+
+void scroll_loop_remove(struct scroll_loop *loop, int fd) {
+	for (int i = 0; i < LOOP_MAX_HANDLERS; ++i) {
+		if (loop->handlers[i].fd == fd) {
+			epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+			loop->handlers[i].fd = -1;
+		}
+	}
+}
+
+void scroll_loop_run(struct scroll_loop *loop) {
+	struct epoll_event events[LOOP_MAX_HANDLERS];
+
+	loop->running = 1;
+	while (loop->running) {
+		int n = epoll_wait(loop->epoll_fd, events, LOOP_MAX_HANDLERS, -1);
+
+		if (n < 0) {
+			_check_or_die(errno == EINTR, "epoll_wait failed: %s", strerror(errno));
+			continue;
+		}
+
+		for (int i = 0; i < n && loop->running; ++i) {
+			struct scroll_loop_handler *handler = events[i].data.ptr;
+
+			/* The handler may have been removed by an earlier callback */
+			if (handler->fd >= 0)
+				handler->cb(handler->fd, events[i].events, handler->data);
+		}
+	}
+}
+
+void scroll_loop_stop(struct scroll_loop *loop) {
+	loop->running = 0;
+}
+
+void scroll_loop_free(struct scroll_loop *loop) {
+	close(loop->epoll_fd);
+}
+
+
+/* Timers */
+int scroll_timer_new(void) {
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	_check_or_die(fd >= 0, "Failed to create timer: %s", strerror(errno));
+	return fd;
+}
+
+/* Arms a periodic timer firing immediately, an interval of 0 disarms it */
+void scroll_timer_set(int fd, long interval_nsec) {
+	struct itimerspec spec = {
+		{ interval_nsec / 1000000000, interval_nsec % 1000000000 },
+		{ 0, interval_nsec ? 1 : 0 }
+	};
+	timerfd_settime(fd, 0, &spec, NULL);
+}
+
+/* Returns how often the timer expired since the last read */
+uint64_t scroll_timer_read(int fd) {
+	uint64_t expirations, res = 0;
+	while (read(fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+		res += expirations;
+	return res;
+}
+
+
+/* Events, used by worker threads to wake up the loop */
+int scroll_event_new(void) {
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	_check_or_die(fd >= 0, "Failed to create eventfd: %s", strerror(errno));
+	return fd;
+}
+
+void scroll_event_notify(int fd) {
+	uint64_t one = 1;
+	while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+		;
+}
+
+/* Returns the number of notifications since the last read */
+int scroll_event_read(int fd) {
+	uint64_t count;
+	if (read(fd, &count, sizeof(count)) != sizeof(count))
+		return 0;
+	return count;
+}
+
+
+/* Signals */
+int scroll_signal_new(const int *signals, int num_signals) {
+	sigset_t mask;
+	sigemptyset(&mask);
+	for (int i = 0; i < num_signals; ++i)
+		sigaddset(&mask, signals[i]);
+
+	_check_or_die(!sigprocmask(SIG_BLOCK, &mask, NULL), "Failed to block signals");
+
+	int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	_check_or_die(fd >= 0, "Failed to create signalfd: %s", strerror(errno));
+	return fd;
+}
+
+/* Returns the next pending signal or 0 */
+int scroll_signal_read(int fd) {
+	struct signalfd_siginfo info;
+	if (read(fd, &info, sizeof(info)) != sizeof(info))
+		return 0;
+	return info.ssi_signo;
+}
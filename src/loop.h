@@ -0,0 +1,41 @@
+#ifndef __loop_h__
+#define __loop_h__
+
+#include <signal.h>
+#include <stdint.h>
+
+#define LOOP_MAX_HANDLERS 16
+
+typedef void (*scroll_loop_cb)(int fd, unsigned int events, void *data);
+
+struct scroll_loop_handler {
+	int fd;
+	scroll_loop_cb cb;
+	void *data;
+};
+
+struct scroll_loop {
+	int epoll_fd;
+	int running;
+	struct scroll_loop_handler handlers[LOOP_MAX_HANDLERS];
+};
+
+void scroll_loop_init(struct scroll_loop *loop);
+void scroll_loop_add(struct scroll_loop *loop, int fd, scroll_loop_cb cb, void *data);
+void scroll_loop_remove(struct scroll_loop *loop, int fd);
+void scroll_loop_run(struct scroll_loop *loop);
+void scroll_loop_stop(struct scroll_loop *loop);
+void scroll_loop_free(struct scroll_loop *loop);
+
+int scroll_timer_new(void);
+void scroll_timer_set(int fd, long interval_nsec);
+uint64_t scroll_timer_read(int fd);
+
+int scroll_event_new(void);
+void scroll_event_notify(int fd);
+int scroll_event_read(int fd);
+
+int scroll_signal_new(const int *signals, int num_signals);
+int scroll_signal_read(int fd);
+
+#endif
@@ -0,0 +1,215 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "utils.h"
+
+static int scroll_metrics_unix(const char *path) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	/* Only replace a socket left behind by an instance which didn't exit cleanly */
+	struct stat st;
+	if (!lstat(path, &st)) {
+		int probe = S_ISSOCK(st.st_mode) ? socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0) : -1;
+		int err = !S_ISSOCK(st.st_mode) ? EEXIST : probe < 0 ? errno :
+			connect(probe, (struct sockaddr *) &addr, sizeof(addr)) ? errno : EADDRINUSE;
+
+		if (probe >= 0)
+			close(probe);
+		if (err != ECONNREFUSED) {
+			close(fd);
+			errno = err;
+			return -1;
+		}
+		unlink(path);
+	}
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, METRICS_MAX_CLIENTS)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int scroll_metrics_http(int port) {
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+	};
+	int one = 1;
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(fd, METRICS_MAX_CLIENTS)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void scroll_metrics_close(struct scroll_metrics *metrics, struct scroll_metrics_client *client) {
+	scroll_loop_remove(metrics->loop, client->fd);
+	close(client->fd);
+	client->fd = -1;
+}
+
+/* The response is small enough for the socket buffer, a client which can't take it at once is dropped */
+static void scroll_metrics_respond(struct scroll_metrics *metrics, struct scroll_metrics_client *client) {
+	char header[128];
+	int ok = !strncmp(client->request, "GET ", 4);
+
+	metrics->len = 0;
+	if (ok)
+		metrics->collect(metrics, metrics->data);
+
+	int len = snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %d\r\n\r\n",
+		ok ? "200 OK" : "405 Method Not Allowed", "text/plain; version=0.0.4", metrics->len);
+
+	/* A client which went away must not raise SIGPIPE */
+	struct iovec iov[2] = { { header, len }, { metrics->buf, metrics->len } };
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+	if (sendmsg(client->fd, &msg, MSG_NOSIGNAL) != len + metrics->len) {
+		_debug("Dropped metrics client");
+	}
+
+	scroll_metrics_close(metrics, client);
+}
+
+static void scroll_metrics_on_client(int fd, unsigned int events, void *data) {
+	struct scroll_metrics *metrics = data;
+	struct scroll_metrics_client *client = NULL;
+
+	for (int i = 0; i < METRICS_MAX_CLIENTS; ++i) {
+		if (metrics->clients[i].fd == fd)
+			client = &metrics->clients[i];
+	}
+
+	ssize_t n = read(fd, client->request + client->len, METRICS_REQUEST_SIZE - 1 - client->len);
+	if (n <= 0) {
+		if (n == 0 || errno != EAGAIN)
+			scroll_metrics_close(metrics, client);
+		return;
+	}
+
+	client->len += n;
+	client->request[client->len] = '\0';
+
+	/* Only the request line matters, but wait for the whole header so the client reads the response */
+	if (strstr(client->request, "\r\n\r\n") || strstr(client->request, "\n\n") ||
+		client->len == METRICS_REQUEST_SIZE - 1)
+		scroll_metrics_respond(metrics, client);
+}
+
+static void scroll_metrics_on_accept(int fd, unsigned int events, void *data) {
+	struct scroll_metrics *metrics = data;
+	int client_fd;
+
+	while ((client_fd = accept(fd, NULL, NULL)) >= 0) {
+		fcntl(client_fd, F_SETFL, O_NONBLOCK);
+		fcntl(client_fd, F_SETFD, FD_CLOEXEC);
+
+		struct scroll_metrics_client *client = &metrics->clients[metrics->next_client];
+		metrics->next_client = (metrics->next_client + 1) % METRICS_MAX_CLIENTS;
+
+		if (client->fd >= 0)
+			scroll_metrics_close(metrics, client);
+
+		client->fd = client_fd;
+		client->len = 0;
+		scroll_loop_add(metrics->loop, client_fd, scroll_metrics_on_client, metrics);
+	}
+}
+
+/* Listens on path and, unless port is 0, on the loopback port. Returns 0 if either fails. */
+int scroll_metrics_init(struct scroll_metrics *metrics, struct scroll_loop *loop, const char *path, int port,
+	void (*collect)(struct scroll_metrics *metrics, void *data), void *data) {
+	metrics->loop = loop;
+	metrics->path = path;
+	metrics->collect = collect;
+	metrics->data = data;
+	metrics->next_client = 0;
+	metrics->unix_fd = -1;
+	metrics->http_fd = -1;
+	for (int i = 0; i < METRICS_MAX_CLIENTS; ++i)
+		metrics->clients[i].fd = -1;
+
+	if (path) {
+		metrics->unix_fd = scroll_metrics_unix(path);
+		_check(metrics->unix_fd >= 0, "Can't listen on %s: %s", path, strerror(errno));
+		scroll_loop_add(loop, metrics->unix_fd, scroll_metrics_on_accept, metrics);
+	}
+
+	if (port) {
+		metrics->http_fd = scroll_metrics_http(port);
+		_check(metrics->http_fd >= 0, "Can't listen on port %d: %s", port, strerror(errno));
+		scroll_loop_add(loop, metrics->http_fd, scroll_metrics_on_accept, metrics);
+	}
+
+	return 1;
+
+error:
+	scroll_metrics_free(metrics);
+	return 0;
+}
+
+void scroll_metrics_free(struct scroll_metrics *metrics) {
+	for (int i = 0; i < METRICS_MAX_CLIENTS; ++i) {
+		if (metrics->clients[i].fd >= 0)
+			scroll_metrics_close(metrics, &metrics->clients[i]);
+	}
+
+	if (metrics->unix_fd >= 0) {
+		scroll_loop_remove(metrics->loop, metrics->unix_fd);
+		close(metrics->unix_fd);
+		unlink(metrics->path);
+		metrics->unix_fd = -1;
+	}
+
+	if (metrics->http_fd >= 0) {
+		scroll_loop_remove(metrics->loop, metrics->http_fd);
+		close(metrics->http_fd);
+		metrics->http_fd = -1;
+	}
+}
+
+/* Appends to the response, output beyond METRICS_BUF_SIZE is cut off */
+void scroll_metrics_printf(struct scroll_metrics *metrics, const char *fmt, ...) {
+	va_list args;
+	int space = METRICS_BUF_SIZE - metrics->len;
+
+	va_start(args, fmt);
+	int n = vsnprintf(metrics->buf + metrics->len, space, fmt, args);
+	va_end(args);
+
+	metrics->len += n < space ? n : space - 1;
+}
+
+void scroll_metrics_header(struct scroll_metrics *metrics, const char *name, const char *type, const char *help) {
+	scroll_metrics_printf(metrics, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void scroll_metrics_value(struct scroll_metrics *metrics, const char *name, const char *type, const char *help,
+	double value) {
+	scroll_metrics_header(metrics, name, type, help);
+	scroll_metrics_printf(metrics, "%s %.15g\n", name, value);
+}
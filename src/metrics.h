@@ -0,0 +1,40 @@
+#ifndef __metrics_h__
+#define __metrics_h__
+
+#include "loop.h"
+
+/* Connections served at the same time, the oldest is dropped for a new one */
+#define METRICS_MAX_CLIENTS 4
+#define METRICS_REQUEST_SIZE 1024
+#define METRICS_BUF_SIZE 16384
+
+struct scroll_metrics_client {
+	int fd;
+	int len;
+	char request[METRICS_REQUEST_SIZE];
+};
+
+/* Serves metrics in Prometheus text format over HTTP on a Unix socket and optionally on a loopback port */
+struct scroll_metrics {
+	struct scroll_loop *loop;
+	const char *path;
+	int unix_fd, http_fd;
+	struct scroll_metrics_client clients[METRICS_MAX_CLIENTS];
+	int next_client;
+	/* Called for every request to print the metrics */
+	void (*collect)(struct scroll_metrics *metrics, void *data);
+	void *data;
+	char buf[METRICS_BUF_SIZE];
+	int len;
+};
+
+int scroll_metrics_init(struct scroll_metrics *metrics, struct scroll_loop *loop, const char *path, int port,
+	void (*collect)(struct scroll_metrics *metrics, void *data), void *data);
+void scroll_metrics_free(struct scroll_metrics *metrics);
+
+void scroll_metrics_printf(struct scroll_metrics *metrics, const char *fmt, ...);
+void scroll_metrics_header(struct scroll_metrics *metrics, const char *name, const char *type, const char *help);
+void scroll_metrics_value(struct scroll_metrics *metrics, const char *name, const char *type, const char *help,
+	double value);
+
+#endif
@@ -0,0 +1,223 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+
+#include "perf.h"
+#include "utils.h"
+
+#define PARANOID "/proc/sys/kernel/perf_event_paranoid"
+
+static const struct {
+	uint64_t config;
+	const char *name;
+} counters[PERF_COUNTERS] = {
+	{ PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+	{ PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+	{ PERF_COUNT_HW_CACHE_MISSES, "cache-misses" },
+	{ PERF_COUNT_HW_BRANCH_MISSES, "branch-misses" },
+};
+
+static const char *phase_names[PERF_END] = { "step", "draw", "scale", "decode" };
+
+/* Counters of one thread, read together. Counters the CPU lacks are left out. */
+struct scroll_perf_group {
+	int fds[PERF_COUNTERS];
+	int counter[PERF_COUNTERS];
+	int num;
+};
+
+static struct {
+	int enabled;
+	int available[PERF_COUNTERS];
+	uint64_t totals[PERF_END][PERF_COUNTERS];
+	uint64_t samples[PERF_END];
+	/* Runs during which the group never got on the PMU */
+	uint64_t unscheduled[PERF_END];
+	uint64_t time_enabled[PERF_END];
+	uint64_t time_running[PERF_END];
+	pthread_key_t key;
+} perf;
+
+static __thread struct scroll_perf_group *thread_group;
+
+static int scroll_perf_open(int counter, int group_fd) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = counters[counter].config;
+	/* Only user space, which perf_event_paranoid 2 still allows */
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	/* The group doesn't get the PMU when other users or the NMI watchdog hold too many counters */
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+static void scroll_perf_close(void *data) {
+	struct scroll_perf_group *group = data;
+	for (int i = 0; i < group->num; ++i)
+		close(group->fds[i]);
+	free(group);
+}
+
+/* Opens the counters of the calling thread, cycles lead the group */
+static struct scroll_perf_group *scroll_perf_group(void) {
+	if (thread_group)
+		return thread_group;
+
+	struct scroll_perf_group *group = calloc(1, sizeof(struct scroll_perf_group));
+	if (!group)
+		return NULL;
+
+	for (int i = 0; i < PERF_COUNTERS; ++i) {
+		int fd = scroll_perf_open(i, group->num ? group->fds[0] : -1);
+		if (fd < 0 && !group->num) {
+			free(group);
+			return NULL;
+		}
+
+		if (fd >= 0) {
+			group->fds[group->num] = fd;
+			group->counter[group->num++] = i;
+		}
+	}
+
+	pthread_setspecific(perf.key, group);
+	thread_group = group;
+	return group;
+}
+
+/* Reads the number of counters, the enabled and running times, then the values */
+static int scroll_perf_read(struct scroll_perf_group *group, struct scroll_perf_sample *sample) {
+	uint64_t buf[3 + PERF_COUNTERS];
+	ssize_t size = sizeof(uint64_t) * (3 + group->num);
+	if (read(group->fds[0], buf, size) != size)
+		return 0;
+
+	sample->time_enabled = buf[1];
+	sample->time_running = buf[2];
+	for (int i = 0; i < group->num; ++i)
+		sample->values[group->counter[i]] = buf[3 + i];
+	return 1;
+}
+
+/* Opens the counters for the main thread, warns and returns 0 if they aren't accessible */
+int scroll_perf_init(void) {
+	pthread_key_create(&perf.key, scroll_perf_close);
+
+	struct scroll_perf_group *group = scroll_perf_group();
+	if (!group) {
+		int err = errno, paranoid = -1;
+		FILE *f = fopen(PARANOID, "r");
+		if (f) {
+			if (fscanf(f, "%d", &paranoid) != 1)
+				paranoid = -1;
+			fclose(f);
+		}
+
+		if (err == EACCES || err == EPERM)
+			_warn("Performance counters need " PARANOID " at 2 or lower, it is %d", paranoid);
+		else
+			_warn("No performance counters: %s", strerror(err));
+		return 0;
+	}
+
+	for (int i = 0; i < group->num; ++i)
+		perf.available[group->counter[i]] = 1;
+	for (int i = 0; i < PERF_COUNTERS; ++i) {
+		if (!perf.available[i])
+			_warn("Performance counter %s not supported", counters[i].name);
+	}
+
+	perf.enabled = 1;
+	return 1;
+}
+
+int scroll_perf_enabled(void) {
+	return perf.enabled;
+}
+
+void scroll_perf_begin(struct scroll_perf_sample *sample) {
+	struct scroll_perf_group *group = perf.enabled ? scroll_perf_group() : NULL;
+	sample->ok = group && scroll_perf_read(group, sample);
+}
+
+/* Adds the counts since scroll_perf_begin on the same thread to the phase, scaled up
+ * when the group only ran part of the time. Runs it didn't run at all are only counted. */
+void scroll_perf_end(struct scroll_perf_sample *sample, enum scroll_perf_phase phase) {
+	struct scroll_perf_sample end = { { 0 }, 0, 0, 0 };
+
+	if (!sample->ok || !scroll_perf_read(thread_group, &end))
+		return;
+
+	uint64_t enabled = end.time_enabled - sample->time_enabled;
+	uint64_t running = end.time_running - sample->time_running;
+	if (!running) {
+		__atomic_add_fetch(&perf.unscheduled[phase], 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	for (int i = 0; i < PERF_COUNTERS; ++i) {
+		uint64_t count = end.values[i] - sample->values[i];
+		if (running < enabled)
+			count = (double) count * enabled / running;
+		__atomic_add_fetch(&perf.totals[phase][i], count, __ATOMIC_RELAXED);
+	}
+	__atomic_add_fetch(&perf.time_enabled[phase], enabled, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&perf.time_running[phase], running, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&perf.samples[phase], 1, __ATOMIC_RELAXED);
+}
+
+static void scroll_perf_rate(char *buf, size_t len, enum scroll_perf_counter counter, uint64_t count,
+	uint64_t instructions) {
+	if (perf.available[counter] && instructions)
+		snprintf(buf, len, "%.2f", count * 1000.0 / instructions);
+	else
+		snprintf(buf, len, "n/a");
+}
+
+/* IPC and misses per thousand instructions of every phase, with the share of the
+ * time the counters were actually running that the counts are estimated from */
+void scroll_perf_report(void) {
+	if (!perf.enabled)
+		return;
+
+	for (int i = 0; i < PERF_END; ++i) {
+		uint64_t totals[PERF_COUNTERS], samples = __atomic_load_n(&perf.samples[i], __ATOMIC_RELAXED);
+		uint64_t unscheduled = __atomic_load_n(&perf.unscheduled[i], __ATOMIC_RELAXED);
+		char ipc[16], cache[16], branch[16];
+
+		for (int j = 0; j < PERF_COUNTERS; ++j)
+			totals[j] = __atomic_load_n(&perf.totals[i][j], __ATOMIC_RELAXED);
+		if (!samples && unscheduled) {
+			_warn("Perf: %-6s %llu runs, the counters were never scheduled, other users or the NMI watchdog hold them",
+				phase_names[i], (unsigned long long) unscheduled);
+			continue;
+		}
+		if (!samples)
+			continue;
+
+		uint64_t enabled = __atomic_load_n(&perf.time_enabled[i], __ATOMIC_RELAXED);
+		uint64_t running = __atomic_load_n(&perf.time_running[i], __ATOMIC_RELAXED);
+		if (unscheduled || running < enabled)
+			_warn("Perf: %-6s counters ran %.0f%% of the time, the counts are scaled up, %llu runs without counts skipped",
+				phase_names[i], enabled ? 100.0 * running / enabled : 100.0, (unsigned long long) unscheduled);
+
+		if (perf.available[PERF_INSTRUCTIONS] && totals[PERF_CYCLES])
+			snprintf(ipc, sizeof(ipc), "%.2f", (double) totals[PERF_INSTRUCTIONS] / totals[PERF_CYCLES]);
+		else
+			snprintf(ipc, sizeof(ipc), "n/a");
+		scroll_perf_rate(cache, sizeof(cache), PERF_CACHE_MISSES, totals[PERF_CACHE_MISSES], totals[PERF_INSTRUCTIONS]);
+		scroll_perf_rate(branch, sizeof(branch), PERF_BRANCH_MISSES, totals[PERF_BRANCH_MISSES], totals[PERF_INSTRUCTIONS]);
+
+		_log("Perf: %-6s %llu runs, %.0f cycles per run, IPC %s, per 1000 instructions %s cache misses, %s branch misses",
+			phase_names[i], (unsigned long long) samples, (double) totals[PERF_CYCLES] / samples, ipc, cache, branch);
+	}
+}
@@ -0,0 +1,37 @@
+#ifndef __perf_h__
+#define __perf_h__
+
+#include <stdint.h>
+
+enum scroll_perf_phase {
+	PERF_STEP = 0,
+	PERF_DRAW,
+	PERF_SCALE,
+	PERF_DECODE,
+	PERF_END
+};
+
+enum scroll_perf_counter {
+	PERF_CYCLES = 0,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_COUNTERS
+};
+
+/* Counter values at the start of a phase on the current thread */
+struct scroll_perf_sample {
+	uint64_t values[PERF_COUNTERS];
+	/* How long the group was enabled and actually on the PMU */
+	uint64_t time_enabled;
+	uint64_t time_running;
+	int ok;
+};
+
+int scroll_perf_init(void);
+int scroll_perf_enabled(void);
+void scroll_perf_begin(struct scroll_perf_sample *sample);
+void scroll_perf_end(struct scroll_perf_sample *sample, enum scroll_perf_phase phase);
+void scroll_perf_report(void);
+
+#endif
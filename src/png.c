@@ -0,0 +1,441 @@
+#ifdef PNG
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include "perf.h"
+#include "png.h"
+#include "prof.h"
+#include "utils.h"
+
+/* Filtered rows in flight between the inflate and unfilter threads */
+#define PNG_RING_ROWS 32
+
+struct scroll_png {
+	struct scroll_loader *loader;
+	const unsigned char *data;
+	size_t size;
+	/* Offset of the first IDAT chunk */
+	size_t idat;
+
+	int width, height;
+	int depth, color_type, channels;
+	/* Bytes per pixel as used by the filters, at least 1 */
+	int bpp;
+	size_t stride;
+
+	uint32_t palette[256];
+	int has_key;
+	int key[3];
+
+	unsigned char *ring;
+	int inflated, unfiltered;
+	int failed;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static uint32_t be32(const unsigned char *p) {
+	return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static int be16(const unsigned char *p) {
+	return p[0] << 8 | p[1];
+}
+
+/* Reads IHDR, PLTE and tRNS, returns 0 for files Imlib has to handle */
+static int scroll_png_header(struct scroll_png *png) {
+	const unsigned char *data = png->data;
+	size_t pos = 8;
+
+	if (png->size < 8 + 25 || memcmp(data, "\x89PNG\r\n\x1a\n", 8) || memcmp(data + 12, "IHDR", 4))
+		return 0;
+
+	png->width = be32(data + 16);
+	png->height = be32(data + 20);
+	png->depth = data[24];
+	png->color_type = data[25];
+
+	/* Adam7 interlacing isn't worth a second code path */
+	if (!png->width || !png->height || png->width > INT16_MAX * 4 || png->height > INT16_MAX * 4 ||
+		data[26] || data[27] || data[28])
+		return 0;
+
+	switch (png->color_type) {
+	case 0: png->channels = 1; break;
+	case 2: png->channels = 3; break;
+	case 3: png->channels = 1; break;
+	case 4: png->channels = 2; break;
+	case 6: png->channels = 4; break;
+	default: return 0;
+	}
+
+	int depth = png->depth;
+	if (depth != 1 && depth != 2 && depth != 4 && depth != 8 && depth != 16)
+		return 0;
+	if ((png->channels > 1 && depth < 8) || (png->color_type == 3 && depth == 16))
+		return 0;
+
+	png->bpp = MAX(1, png->channels * depth / 8);
+	png->stride = ((size_t) png->width * png->channels * depth + 7) / 8;
+
+	for (int i = 0; i < 256; i++)
+		png->palette[i] = 0xff000000;
+
+	while (pos + 12 <= png->size) {
+		size_t len = be32(data + pos);
+		const unsigned char *type = data + pos + 4;
+		const unsigned char *chunk = data + pos + 8;
+
+		if (len > png->size - pos - 12)
+			return 0;
+
+		if (!memcmp(type, "IDAT", 4)) {
+			png->idat = pos;
+			return 1;
+		} else if (!memcmp(type, "PLTE", 4)) {
+			for (size_t i = 0; i < len / 3 && i < 256; i++)
+				png->palette[i] = 0xff000000 | chunk[3 * i] << 16 | chunk[3 * i + 1] << 8 | chunk[3 * i + 2];
+		} else if (!memcmp(type, "tRNS", 4)) {
+			if (png->color_type == 3) {
+				for (size_t i = 0; i < len && i < 256; i++)
+					png->palette[i] = (png->palette[i] & 0xffffff) | (uint32_t) chunk[i] << 24;
+			} else if (len >= 2 * (size_t) png->channels) {
+				png->has_key = 1;
+				for (int i = 0; i < png->channels; i++)
+					png->key[i] = be16(chunk + 2 * i);
+			}
+		}
+
+		pos += len + 12;
+	}
+
+	return 0;
+}
+
+/* Inflates the IDAT chunks into the ring while the loader thread unfilters earlier rows */
+static void *scroll_png_inflate_thread(void *data) {
+	struct scroll_png *png = data;
+	scroll_prof_thread();
+	size_t row_size = png->stride + 1, filled = 0;
+	size_t pos = png->idat;
+	int row = 0, ret = Z_OK;
+	z_stream z;
+	struct scroll_perf_sample perf;
+	scroll_perf_begin(&perf);
+
+	memset(&z, 0, sizeof(z));
+	if (inflateInit(&z) != Z_OK)
+		ret = Z_MEM_ERROR;
+
+	while (ret == Z_OK && row < png->height && pos + 12 <= png->size) {
+		size_t len = be32(png->data + pos);
+		if (len > png->size - pos - 12)
+			break;
+
+		if (!memcmp(png->data + pos + 4, "IEND", 4))
+			break;
+
+		if (memcmp(png->data + pos + 4, "IDAT", 4)) {
+			pos += len + 12;
+			continue;
+		}
+
+		z.next_in = (unsigned char *) png->data + pos + 8;
+		z.avail_in = len;
+
+		while (ret == Z_OK && z.avail_in && row < png->height) {
+			if (!filled) {
+				pthread_mutex_lock(&png->lock);
+				while (row - png->unfiltered >= PNG_RING_ROWS && !png->failed)
+					pthread_cond_wait(&png->cond, &png->lock);
+				if (png->failed)
+					ret = Z_STREAM_ERROR;
+				pthread_mutex_unlock(&png->lock);
+
+				if (ret != Z_OK)
+					break;
+			}
+
+			z.next_out = png->ring + (row % PNG_RING_ROWS) * row_size + filled;
+			z.avail_out = row_size - filled;
+			ret = inflate(&z, Z_NO_FLUSH);
+			filled = row_size - z.avail_out;
+
+			if (filled == row_size) {
+				filled = 0;
+				row++;
+
+				pthread_mutex_lock(&png->lock);
+				png->inflated = row;
+				pthread_cond_broadcast(&png->cond);
+				pthread_mutex_unlock(&png->lock);
+			}
+
+			if (ret == Z_STREAM_END && row < png->height)
+				ret = Z_DATA_ERROR;
+		}
+
+		pos += len + 12;
+	}
+
+	inflateEnd(&z);
+
+	pthread_mutex_lock(&png->lock);
+	if (row < png->height)
+		png->failed = 1;
+	pthread_cond_broadcast(&png->cond);
+	pthread_mutex_unlock(&png->lock);
+
+	scroll_perf_end(&perf, PERF_DECODE);
+	return NULL;
+}
+
+static int paeth(int a, int b, int c) {
+	int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+	if (pa <= pb && pa <= pc)
+		return a;
+	return pb <= pc ? b : c;
+}
+
+static int scroll_png_unfilter(int filter, unsigned char *cur, const unsigned char *raw,
+	const unsigned char *prev, size_t stride, int bpp) {
+	size_t i;
+
+	switch (filter) {
+	case 0:
+		memcpy(cur, raw, stride);
+		break;
+	case 1:
+		memcpy(cur, raw, bpp);
+		for (i = bpp; i < stride; i++)
+			cur[i] = raw[i] + cur[i - bpp];
+		break;
+	case 2:
+		for (i = 0; i < stride; i++)
+			cur[i] = raw[i] + prev[i];
+		break;
+	case 3:
+		for (i = 0; i < (size_t) bpp; i++)
+			cur[i] = raw[i] + (prev[i] >> 1);
+		for (; i < stride; i++)
+			cur[i] = raw[i] + ((cur[i - bpp] + prev[i]) >> 1);
+		break;
+	case 4:
+		for (i = 0; i < (size_t) bpp; i++)
+			cur[i] = raw[i] + prev[i];
+		for (; i < stride; i++)
+			cur[i] = raw[i] + paeth(cur[i - bpp], prev[i], prev[i - bpp]);
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+/* Sample c of pixel x at the image's bit depth */
+static inline int png_sample(const unsigned char *row, int x, int c, int channels, int depth) {
+	switch (depth) {
+	case 8:
+		return row[x * channels + c];
+	case 16:
+		return be16(row + 2 * (x * channels + c));
+	default: {
+		int bit = x * depth;
+		return row[bit >> 3] >> (8 - depth - (bit & 7)) & ((1 << depth) - 1);
+	}
+	}
+}
+
+static inline int png_to_8bit(int v, int depth) {
+	return depth == 16 ? v >> 8 : depth == 8 ? v : v * 255 / ((1 << depth) - 1);
+}
+
+/* Converts an unfiltered row to ARGB */
+static void scroll_png_convert(const struct scroll_png *png, const unsigned char *row, uint32_t *out) {
+	int channels = png->channels, depth = png->depth;
+
+	/* The common case */
+	if (depth == 8 && channels >= 3 && !png->has_key) {
+		for (int x = 0; x < png->width; x++, row += channels) {
+			uint32_t a = channels == 4 ? row[3] : 0xff;
+			out[x] = a << 24 | row[0] << 16 | row[1] << 8 | row[2];
+		}
+		return;
+	}
+
+	for (int x = 0; x < png->width; x++) {
+		int s[4] = { 0, 0, 0, 0 };
+		for (int c = 0; c < channels; c++)
+			s[c] = png_sample(row, x, c, channels, depth);
+
+		uint32_t a = 0xff, r, g, b;
+		switch (png->color_type) {
+		case 3:
+			out[x] = png->palette[s[0]];
+			continue;
+		case 0:
+		case 4:
+			r = g = b = png_to_8bit(s[0], depth);
+			if (channels == 2)
+				a = png_to_8bit(s[1], depth);
+			else if (png->has_key && s[0] == png->key[0])
+				a = 0;
+			break;
+		default:
+			r = png_to_8bit(s[0], depth);
+			g = png_to_8bit(s[1], depth);
+			b = png_to_8bit(s[2], depth);
+			if (channels == 4)
+				a = png_to_8bit(s[3], depth);
+			else if (png->has_key && s[0] == png->key[0] && s[1] == png->key[1] && s[2] == png->key[2])
+				a = 0;
+			break;
+		}
+
+		out[x] = a << 24 | r << 16 | g << 8 | b;
+	}
+}
+
+static int scroll_png_decode(struct scroll_png *png, uint32_t *pixels) {
+	size_t row_size = png->stride + 1;
+	pthread_t thread;
+
+	png->ring = malloc(row_size * PNG_RING_ROWS);
+	unsigned char *prev = calloc(1, png->stride);
+	unsigned char *cur = malloc(png->stride);
+	_check_or_die(png->ring && prev && cur, "Failed to allocate PNG rows");
+
+	pthread_mutex_init(&png->lock, NULL);
+	pthread_cond_init(&png->cond, NULL);
+
+	int started = !pthread_create(&thread, NULL, scroll_png_inflate_thread, png);
+	int ok = started;
+
+	for (int y = 0; ok && y < png->height; y++) {
+		pthread_mutex_lock(&png->lock);
+		while (png->inflated <= y && !png->failed)
+			pthread_cond_wait(&png->cond, &png->lock);
+		ok = !png->failed;
+		pthread_mutex_unlock(&png->lock);
+
+		if (!ok)
+			break;
+
+		const unsigned char *raw = png->ring + (y % PNG_RING_ROWS) * row_size;
+		ok = scroll_png_unfilter(raw[0], cur, raw + 1, prev, png->stride, png->bpp) &&
+			!scroll_loader_cancelled(png->loader);
+
+		/* Hands the slot back before converting, so inflate can continue meanwhile */
+		pthread_mutex_lock(&png->lock);
+		png->unfiltered = y + 1;
+		png->failed |= !ok;
+		pthread_cond_broadcast(&png->cond);
+		pthread_mutex_unlock(&png->lock);
+
+		scroll_png_convert(png, cur, pixels + (size_t) y * png->width);
+
+		unsigned char *tmp = prev;
+		prev = cur;
+		cur = tmp;
+	}
+
+	if (started)
+		pthread_join(thread, NULL);
+	pthread_mutex_destroy(&png->lock);
+	pthread_cond_destroy(&png->cond);
+
+	free(png->ring);
+	free(prev);
+	free(cur);
+
+	return ok;
+}
+
+/* Decodes non-interlaced PNGs with inflate and unfilter running on separate threads.
+ * Returns 0 if the file should be loaded by Imlib instead. */
+int scroll_png_load(struct scroll_loader *loader) {
+	struct scroll_image *image = loader->image;
+	struct scroll_png png;
+	struct stat st;
+
+	int fd = open(loader->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	if (fstat(fd, &st) || st.st_size < 8) {
+		close(fd);
+		return 0;
+	}
+
+	unsigned char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return 0;
+
+	memset(&png, 0, sizeof(png));
+	png.loader = loader;
+	png.data = data;
+	png.size = st.st_size;
+
+	if (!scroll_png_header(&png)) {
+		munmap(data, st.st_size);
+		return 0;
+	}
+
+	/* There is no reduced resolution to fall back to, rather fail than exceed the memory budget */
+	if (loader->budgeted) {
+		int target_width, target_height;
+		size_t max_bytes, bytes = sizeof(uint32_t) * png.width * png.height;
+
+		if (!scroll_loader_target(loader, &target_width, &target_height, &max_bytes)) {
+			munmap(data, st.st_size);
+			return 1;
+		}
+
+		if (max_bytes && bytes > max_bytes) {
+			_warn("The %dx%d PNG needs %.1f MiB, %.1f MiB of the memory budget are left and PNGs are only decoded at full size",
+				png.width, png.height, bytes / (1024.0 * 1024.0), max_bytes / (1024.0 * 1024.0));
+			munmap(data, st.st_size);
+			return 1;
+		}
+	}
+
+	uint32_t *pixels = malloc(sizeof(uint32_t) * png.width * png.height);
+	_check_or_die(pixels, "Failed to allocate %dx%d image", png.width, png.height);
+
+	int ok = scroll_png_decode(&png, pixels);
+	munmap(data, st.st_size);
+
+	if (scroll_loader_cancelled(loader)) {
+		free(pixels);
+		return 1;
+	}
+
+	if (!ok) {
+		_warn("Failed to decode PNG, falling back to Imlib");
+		free(pixels);
+		return 0;
+	}
+
+	_debug("Decoded %dx%d PNG", png.width, png.height);
+
+	image->width = png.width;
+	image->height = png.height;
+	image->full_width = png.width;
+	image->full_height = png.height;
+	image->pixels = pixels;
+	image->handle = NULL;
+	loader->ok = 1;
+
+	return 1;
+}
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef __png_h__
+#define __png_h__
+
+#include "image.h"
+
+int scroll_png_load(struct scroll_loader *loader);
+
+#endif
@@ -0,0 +1,91 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "power.h"
+#include "utils.h"
+
+#define POWER_SUPPLY_DIR "/sys/class/power_supply"
+#define PLATFORM_PROFILE "/sys/firmware/acpi/platform_profile"
+#define PPD_STATE "/var/lib/power-profiles-daemon/state.ini"
+
+/* Read the first line of a file without the trailing newline */
+static int read_line(const char *path, char *buf, int len) {
+	FILE *f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	if (!fgets(buf, len, f)) {
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+
+	buf[strcspn(buf, "\n")] = '\0';
+	return 1;
+}
+
+static int read_attr(const char *supply, const char *attr, char *buf, int len) {
+	char path[512];
+	snprintf(path, sizeof(path), POWER_SUPPLY_DIR "/%s/%s", supply, attr);
+	return read_line(path, buf, len);
+}
+
+/* Returns 1 if no external supply is online and a battery is discharging */
+int scroll_power_on_battery(void) {
+	DIR *dir = opendir(POWER_SUPPLY_DIR);
+	if (!dir)
+		return 0;
+
+	struct dirent *ent;
+	char type[32], buf[32];
+	int discharging = 0;
+
+	while ((ent = readdir(dir))) {
+		if (ent->d_name[0] == '.' || !read_attr(ent->d_name, "type", type, sizeof(type)))
+			continue;
+
+		if (!strcmp(type, "Mains") || !strcmp(type, "USB")) {
+			if (read_attr(ent->d_name, "online", buf, sizeof(buf)) && !strcmp(buf, "1")) {
+				closedir(dir);
+				return 0;
+			}
+		} else if (!strcmp(type, "Battery")) {
+			if (read_attr(ent->d_name, "status", buf, sizeof(buf)) && !strcmp(buf, "Discharging"))
+				discharging = 1;
+		}
+	}
+
+	closedir(dir);
+	return discharging;
+}
+
+/* Returns 1 if the platform or power-profiles-daemon asks for power saving */
+int scroll_power_saver(void) {
+	char buf[64];
+
+	if (read_line(PLATFORM_PROFILE, buf, sizeof(buf)) &&
+		(!strcmp(buf, "low-power") || !strcmp(buf, "quiet")))
+		return 1;
+
+	FILE *f = fopen(PPD_STATE, "r");
+	if (!f)
+		return 0;
+
+	int saver = 0;
+	while (fgets(buf, sizeof(buf), f)) {
+		if (!strncmp(buf, "Profile=power-saver", 19)) {
+			saver = 1;
+			break;
+		}
+	}
+	fclose(f);
+
+	return saver;
+}
+
+int scroll_power_low(void) {
+	int res = scroll_power_on_battery() || scroll_power_saver();
+	_debug("Power state: %s", res ? "low" : "normal");
+	return res;
+}
@@ -0,0 +1,12 @@
+#ifndef __power_h__
+#define __power_h__
+
+/* How often the power supply state is polled. sysfs attributes don't
+ * support inotify, so this is kept low-frequency instead. */
+#define POWER_POLL_MILLIS 5000
+
+int scroll_power_on_battery(void);
+int scroll_power_saver(void);
+int scroll_power_low(void);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef __probes_h__
+#define __probes_h__
+
+/* USDT probes in the scroll provider, e.g. bpftrace -e 'usdt:./scroll:scroll:frame_end { ... }'.
+ * Each is a nop until a tracer attaches, without SDT they compile to nothing. */
+#if defined(SDT) && defined(__has_include)
+#if !__has_include(<sys/sdt.h>)
+#warning "SDT set but sys/sdt.h is missing, building without probes"
+#undef SDT
+#endif
+#endif
+
+#ifdef SDT
+#include <sys/sdt.h>
+
+#define PROBE(name) DTRACE_PROBE(scroll, name)
+#define PROBE1(name, a) DTRACE_PROBE1(scroll, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(scroll, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(scroll, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(scroll, name, a, b, c, d)
+#else
+#define PROBE(name)
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#define PROBE4(name, a, b, c, d)
+#endif
+
+#endif
@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "prof.h"
+#include "utils.h"
+
+/* Older glibc only has the union member */
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/* The handler and the signal trampoline */
+#define PROF_SKIP 2
+
+/* Seq is 0 while the handler writes the sample and its index plus one after */
+struct scroll_prof_sample {
+	uint64_t seq;
+	int depth;
+	void *frames[PROF_MAX_DEPTH + PROF_SKIP];
+};
+
+static struct {
+	char *path;
+	long interval;
+	struct scroll_prof_sample *ring;
+	uint64_t next;
+	pthread_key_t key;
+} prof;
+
+/* A function of the executable, addresses relative to its load base */
+struct scroll_prof_function {
+	uintptr_t start, end;
+	const char *name;
+};
+
+/* Functions from the executable's symbol table, including static ones dladdr can't see */
+static struct {
+	void *map;
+	size_t map_size;
+	uintptr_t base;
+	void *fbase;
+	struct scroll_prof_function *functions;
+	int num;
+	int loaded;
+} elf;
+
+static __thread timer_t *thread_timer;
+
+/* Only async signal safe calls, backtrace is once libgcc is loaded */
+static void scroll_prof_handler(int sig) {
+	int saved = errno;
+	uint64_t seq = __atomic_fetch_add(&prof.next, 1, __ATOMIC_RELAXED);
+	struct scroll_prof_sample *sample = &prof.ring[seq % PROF_RING_SAMPLES];
+
+	__atomic_store_n(&sample->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	sample->depth = backtrace(sample->frames, PROF_MAX_DEPTH + PROF_SKIP);
+	__atomic_store_n(&sample->seq, seq + 1, __ATOMIC_RELEASE);
+	errno = saved;
+}
+
+static void scroll_prof_thread_exit(void *data) {
+	timer_t *timer = data;
+	timer_delete(*timer);
+	free(timer);
+}
+
+/* Samples the calling thread's CPU time, so every thread is sampled at the same rate while it runs */
+void scroll_prof_thread(void) {
+	if (!prof.ring || thread_timer)
+		return;
+
+	timer_t *timer = malloc(sizeof(timer_t));
+	if (!timer)
+		return;
+
+	struct sigevent event;
+	memset(&event, 0, sizeof(event));
+	event.sigev_notify = SIGEV_THREAD_ID;
+	event.sigev_signo = SIGPROF;
+	event.sigev_notify_thread_id = syscall(SYS_gettid);
+	if (timer_create(CLOCK_THREAD_CPUTIME_ID, &event, timer)) {
+		_debug("Failed to create profiling timer: %s", strerror(errno));
+		free(timer);
+		return;
+	}
+
+	struct itimerspec spec = { { 0, prof.interval }, { 0, prof.interval } };
+	timer_settime(*timer, 0, &spec, NULL);
+	thread_timer = timer;
+	pthread_setspecific(prof.key, timer);
+}
+
+int scroll_prof_start(const char *path, int hz) {
+	prof.ring = calloc(PROF_RING_SAMPLES, sizeof(struct scroll_prof_sample));
+	if (!prof.ring)
+		return 0;
+
+	prof.path = strdup(path);
+	prof.interval = 1000000000L / MIN(MAX(hz, 1), PROF_MAX_HZ);
+	prof.next = 0;
+	pthread_key_create(&prof.key, scroll_prof_thread_exit);
+
+	/* The first backtrace loads libgcc, which isn't safe in the handler */
+	void *frames[1];
+	backtrace(frames, 1);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = scroll_prof_handler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGPROF, &action, NULL);
+
+	scroll_prof_thread();
+	return 1;
+}
+
+int scroll_profiling(void) {
+	return prof.ring != NULL;
+}
+
+static int scroll_prof_compare(const void *a, const void *b) {
+	const struct scroll_prof_sample *x = a, *y = b;
+	if (x->depth != y->depth)
+		return x->depth - y->depth;
+	return memcmp(x->frames, y->frames, x->depth * sizeof(void *));
+}
+
+static int scroll_prof_function_compare(const void *a, const void *b) {
+	const struct scroll_prof_function *x = a, *y = b;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Reads the symbol table of /proc/self/exe, which is gone if the binary was stripped */
+static void scroll_prof_load_functions(void) {
+	Dl_info info;
+	struct stat st;
+
+	elf.loaded = 1;
+	if (!dladdr((void *) scroll_prof_load_functions, &info))
+		return;
+	elf.fbase = info.dli_fbase;
+
+	int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) || (size_t) st.st_size < sizeof(Elf64_Ehdr)) {
+		close(fd);
+		return;
+	}
+
+	elf.map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (elf.map == MAP_FAILED) {
+		elf.map = NULL;
+		return;
+	}
+	elf.map_size = st.st_size;
+
+	const unsigned char *data = elf.map;
+	const Elf64_Ehdr *header = elf.map;
+	if (memcmp(header->e_ident, ELFMAG, SELFMAG) || header->e_ident[EI_CLASS] != ELFCLASS64 ||
+		header->e_shoff + (size_t) header->e_shnum * sizeof(Elf64_Shdr) > elf.map_size)
+		return;
+
+	/* Position independent executables have their symbols relative to the load base */
+	elf.base = header->e_type == ET_DYN ? (uintptr_t) elf.fbase : 0;
+
+	const Elf64_Shdr *sections = (const Elf64_Shdr *) (data + header->e_shoff);
+	for (int i = 0; i < header->e_shnum; ++i) {
+		const Elf64_Shdr *symtab = &sections[i];
+		if (symtab->sh_type != SHT_SYMTAB || symtab->sh_link >= header->e_shnum)
+			continue;
+
+		const Elf64_Shdr *strtab = &sections[symtab->sh_link];
+		if (symtab->sh_offset + symtab->sh_size > elf.map_size || strtab->sh_offset + strtab->sh_size > elf.map_size)
+			return;
+
+		const Elf64_Sym *symbols = (const Elf64_Sym *) (data + symtab->sh_offset);
+		size_t num = symtab->sh_size / sizeof(Elf64_Sym);
+		elf.functions = malloc(num * sizeof(struct scroll_prof_function));
+		if (!elf.functions)
+			return;
+
+		for (size_t j = 0; j < num; ++j) {
+			if (ELF64_ST_TYPE(symbols[j].st_info) != STT_FUNC || !symbols[j].st_value ||
+				symbols[j].st_name >= strtab->sh_size)
+				continue;
+			elf.functions[elf.num++] = (struct scroll_prof_function) { symbols[j].st_value,
+				symbols[j].st_value + symbols[j].st_size, (const char *) data + strtab->sh_offset + symbols[j].st_name };
+		}
+
+		qsort(elf.functions, elf.num, sizeof(struct scroll_prof_function), scroll_prof_function_compare);
+		return;
+	}
+
+	_warn("Profile: scroll is stripped, its own functions are written as offsets, build without STRIPFLAGS");
+}
+
+/* The executable's function containing addr, NULL if it isn't in the symbol table */
+static const struct scroll_prof_function *scroll_prof_function(void *addr) {
+	Dl_info info;
+
+	if (!elf.loaded)
+		scroll_prof_load_functions();
+	if (!elf.num || !dladdr(addr, &info) || info.dli_fbase != elf.fbase)
+		return NULL;
+
+	uintptr_t pc = (uintptr_t) addr - elf.base;
+	int low = 0, high = elf.num - 1, found = -1;
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		if (elf.functions[mid].start <= pc) {
+			found = mid;
+			low = mid + 1;
+		} else {
+			high = mid - 1;
+		}
+	}
+
+	/* Sizes of 0 are hand written code, they reach up to the next function */
+	if (found < 0 || (elf.functions[found].end > elf.functions[found].start && pc >= elf.functions[found].end))
+		return NULL;
+	return &elf.functions[found];
+}
+
+/* Function name, or library and offset for addr2line */
+static void scroll_prof_symbol(FILE *file, void *addr) {
+	const struct scroll_prof_function *function = scroll_prof_function(addr);
+	Dl_info info;
+
+	if (function) {
+		fputs(function->name, file);
+	} else if (!dladdr(addr, &info) || !info.dli_fname) {
+		fprintf(file, "%p", addr);
+	} else if (info.dli_sname) {
+		fputs(info.dli_sname, file);
+	} else {
+		const char *name = strrchr(info.dli_fname, '/');
+		fprintf(file, "%s+0x%lx", name ? name + 1 : info.dli_fname,
+			(unsigned long) ((char *) addr - (char *) info.dli_fbase));
+	}
+}
+
+/* Start of the function where it is known, so samples anywhere in it fold together.
+ * Return addresses point past the call, except for the interrupted frame. */
+static void *scroll_prof_frame(void *addr, int caller) {
+	const struct scroll_prof_function *function;
+	Dl_info info;
+
+	if (caller)
+		addr = (char *) addr - 1;
+	if ((function = scroll_prof_function(addr)))
+		return (void *) (elf.base + function->start);
+	if (dladdr(addr, &info) && info.dli_sname && info.dli_saddr)
+		return info.dli_saddr;
+	return addr;
+}
+
+/* Folded stacks of the samples in the ring, for flamegraph.pl */
+void scroll_prof_write(void) {
+	if (!prof.ring)
+		return;
+
+	struct scroll_prof_sample *samples = malloc(PROF_RING_SAMPLES * sizeof(struct scroll_prof_sample));
+	if (!samples)
+		return;
+
+	/* Copy first, a sample torn by a handler on another thread is left out */
+	int num = 0;
+	for (int i = 0; i < PROF_RING_SAMPLES; ++i) {
+		struct scroll_prof_sample *sample = &prof.ring[i];
+		uint64_t seq = __atomic_load_n(&sample->seq, __ATOMIC_ACQUIRE);
+		if (!seq)
+			continue;
+
+		memcpy(&samples[num], sample, sizeof(struct scroll_prof_sample));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&sample->seq, __ATOMIC_RELAXED) != seq || samples[num].depth <= PROF_SKIP)
+			continue;
+
+		samples[num].depth -= PROF_SKIP;
+		memmove(samples[num].frames, samples[num].frames + PROF_SKIP, samples[num].depth * sizeof(void *));
+		for (int j = 0; j < samples[num].depth; ++j)
+			samples[num].frames[j] = scroll_prof_frame(samples[num].frames[j], j);
+		++num;
+	}
+
+	FILE *file = fopen(prof.path, "w");
+	if (!file) {
+		_warn("Can't open profile %s: %s", prof.path, strerror(errno));
+		free(samples);
+		return;
+	}
+
+	qsort(samples, num, sizeof(struct scroll_prof_sample), scroll_prof_compare);
+	for (int i = 0, count; i < num; i += count) {
+		for (count = 1; i + count < num && !scroll_prof_compare(&samples[i], &samples[i + count]); ++count)
+			;
+
+		/* Root first */
+		for (int j = samples[i].depth - 1; j >= 0; --j) {
+			scroll_prof_symbol(file, samples[i].frames[j]);
+			fputc(j ? ';' : ' ', file);
+		}
+		fprintf(file, "%d\n", count);
+	}
+
+	fclose(file);
+	_log("Profile: wrote %d of %llu samples to %s", num, (unsigned long long) prof.next, prof.path);
+	free(samples);
+}
+
+/* After the other threads are joined */
+void scroll_prof_stop(void) {
+	if (!prof.ring)
+		return;
+
+	if (thread_timer) {
+		scroll_prof_thread_exit(thread_timer);
+		thread_timer = NULL;
+		pthread_setspecific(prof.key, NULL);
+	}
+	signal(SIGPROF, SIG_IGN);
+
+	scroll_prof_write();
+	free(prof.ring);
+	free(prof.path);
+	prof.ring = NULL;
+
+	free(elf.functions);
+	if (elf.map)
+		munmap(elf.map, elf.map_size);
+	memset(&elf, 0, sizeof(elf));
+}
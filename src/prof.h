@@ -0,0 +1,18 @@
+#ifndef __prof_h__
+#define __prof_h__
+
+#include <stdint.h>
+
+/* Most recent samples kept, older ones are overwritten */
+#define PROF_RING_SAMPLES 8192
+#define PROF_MAX_DEPTH 32
+#define PROF_DEFAULT_HZ 99
+#define PROF_MAX_HZ 1000
+
+int scroll_prof_start(const char *path, int hz);
+int scroll_profiling(void);
+void scroll_prof_thread(void);
+void scroll_prof_write(void);
+void scroll_prof_stop(void);
+
+#endif
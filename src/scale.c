@@ -0,0 +1,1048 @@
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <X11/Xutil.h>
+
+#include "perf.h"
+#include "prof.h"
+#include "scale.h"
+#include "trace.h"
+#include "utils.h"
+
+/* Filter weights are 2.14 fixed point, the intermediate rows 8.7 fixed point */
+#define WEIGHT_BITS 14
+#define ROW_BITS 7
+
+/* Each scaling thread gets at least this many output rows */
+#define SCALE_BAND_ROWS 64
+#define SCALE_MAX_BANDS 16
+
+/* Source pixels contributing to one destination pixel */
+struct scroll_contrib {
+	int start, count;
+	int16_t *weights;
+};
+
+static int mask_shift(unsigned long mask, int *shift, int *bits) {
+	if (!mask)
+		return 0;
+
+	for (*shift = 0; !(mask & 1); ++*shift)
+		mask >>= 1;
+	for (*bits = 0; mask & 1; ++*bits)
+		mask >>= 1;
+
+	return *bits <= 8;
+}
+
+/* Bits per pixel of pixmaps with the given depth, 0 if the server has none */
+int scroll_depth_bpp(Display *display, int depth) {
+	int num_formats, bpp = 0;
+	XPixmapFormatValues *formats = XListPixmapFormats(display, &num_formats);
+	for (int i = 0; formats && i < num_formats; ++i) {
+		if (formats[i].depth == depth)
+			bpp = formats[i].bits_per_pixel;
+	}
+	XFree(formats);
+	return bpp;
+}
+
+/* Returns 0 if the visual's pixels can't be produced directly */
+int scroll_format_init(struct scroll_format *fmt, Display *display, Visual *visual, int depth) {
+	if (visual->class != TrueColor)
+		return 0;
+
+	int bpp = scroll_depth_bpp(display, depth);
+	if (bpp != 16 && bpp != 32)
+		return 0;
+
+	fmt->bytes_per_pixel = bpp / 8;
+	return mask_shift(visual->red_mask, &fmt->red_shift, &fmt->red_bits) &&
+		mask_shift(visual->green_mask, &fmt->green_shift, &fmt->green_bits) &&
+		mask_shift(visual->blue_mask, &fmt->blue_shift, &fmt->blue_bits);
+}
+
+
+/* Filter weights */
+struct scroll_filter_def {
+	const char *name;
+	double support;
+	double (*fn)(double x);
+};
+
+static double box(double x) {
+	return x >= -0.5 && x < 0.5;
+}
+
+static double tent(double x) {
+	x = fabs(x);
+	return x < 1 ? 1 - x : 0;
+}
+
+static double lanczos3(double x) {
+	x = fabs(x);
+	if (x < 1e-9)
+		return 1;
+	if (x >= 3)
+		return 0;
+	return 3 * sin(M_PI * x) * sin(M_PI * x / 3) / (M_PI * M_PI * x * x);
+}
+
+static const struct scroll_filter_def filters[FILTER_END] = {
+	[FILTER_BOX] = { "box", 0.5, box },
+	[FILTER_BILINEAR] = { "bilinear", 1, tent },
+	[FILTER_LANCZOS3] = { "lanczos", 3, lanczos3 },
+};
+
+/* Returns -1 for unknown names */
+int scroll_filter_parse(const char *name) {
+	for (int i = 0; i < FILTER_END; ++i) {
+		if (!strcmp(filters[i].name, name))
+			return i;
+	}
+	return -1;
+}
+
+const char *scroll_filter_name(enum scroll_filter filter) {
+	return filters[filter].name;
+}
+
+static struct scroll_contrib *scroll_contribs(int src_size, int dst_size, enum scroll_filter filter, int *max_count) {
+	const struct scroll_filter_def *def = &filters[filter];
+	double scale = (double) dst_size / src_size;
+
+	/* Widen the filter when downscaling so every source pixel contributes */
+	double filter_scale = scale < 1 ? scale : 1;
+	double support = def->support / filter_scale;
+	int span = (int) ceil(support) * 2 + 1;
+
+	struct scroll_contrib *res = malloc(sizeof(struct scroll_contrib) * dst_size);
+	int16_t *weights = malloc(sizeof(int16_t) * span * dst_size);
+	double *buf = malloc(sizeof(double) * span);
+	_check_or_die(res && weights && buf, "Failed to allocate filter weights");
+
+	*max_count = 1;
+
+	for (int i = 0; i < dst_size; ++i) {
+		double center = (i + 0.5) / scale;
+		int left = floor(center - support);
+		int right = ceil(center + support);
+		double sum = 0;
+
+		if (left < 0)
+			left = 0;
+		if (right > src_size)
+			right = src_size;
+		if (right - left > span)
+			right = left + span;
+
+		for (int j = left; j < right; ++j) {
+			buf[j - left] = def->fn((j + 0.5 - center) * filter_scale);
+			sum += buf[j - left];
+		}
+
+		res[i].start = left;
+		res[i].count = right - left;
+		res[i].weights = weights + i * span;
+
+		/* Fall back to the nearest pixel if the filter missed every pixel */
+		if (sum <= 0) {
+			res[i].start = center < src_size ? (int) center : src_size - 1;
+			res[i].count = 1;
+			res[i].weights[0] = 1 << WEIGHT_BITS;
+			continue;
+		}
+
+		/* Quantize and put the rounding error on the largest weight */
+		int total = 0, largest = 0;
+		for (int j = 0; j < res[i].count; ++j) {
+			res[i].weights[j] = lround(buf[j] / sum * (1 << WEIGHT_BITS));
+			total += res[i].weights[j];
+			if (res[i].weights[j] > res[i].weights[largest])
+				largest = j;
+		}
+		res[i].weights[largest] += (1 << WEIGHT_BITS) - total;
+
+		/* Drop zero weights at the edges, box filters produce them */
+		int skip = 0;
+		while (skip < res[i].count - 1 && !res[i].weights[skip])
+			++skip;
+		res[i].start += skip;
+		res[i].count -= skip;
+		memmove(res[i].weights, res[i].weights + skip, sizeof(int16_t) * res[i].count);
+		while (res[i].count > 1 && !res[i].weights[res[i].count - 1])
+			--res[i].count;
+
+		if (res[i].count > *max_count)
+			*max_count = res[i].count;
+	}
+
+	free(buf);
+	return res;
+}
+
+static void scroll_contribs_free(struct scroll_contrib *contribs) {
+	free(contribs[0].weights);
+	free(contribs);
+}
+
+
+/* Passes. Intermediate rows hold 4 channels per pixel in the byte order of the pixels in memory,
+ * so the vector versions can unpack bytes directly. All versions produce identical results.
+ * The 16 bit versions filter linear light rows, which use the same 8.7 range. */
+static inline int16_t clamp_row(int v) {
+	return v < 0 ? 0 : v > INT16_MAX ? INT16_MAX : v;
+}
+
+static inline uint8_t clamp_pixel(int v) {
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+typedef void (*scale_row_h_fn)(const uint32_t *src, int16_t *dst, const struct scroll_contrib *contribs, int width);
+typedef void (*scale_row_h16_fn)(const int16_t *src, int16_t *dst, const struct scroll_contrib *contribs, int width);
+typedef void (*scale_row_v_fn)(int16_t *const *rows, const int16_t *weights, int count, int width, uint32_t *dst);
+typedef void (*scale_row_v16_fn)(int16_t *const *rows, const int16_t *weights, int count, int width, int16_t *dst);
+
+static void scale_row_h_c(const uint32_t *src, int16_t *dst, const struct scroll_contrib *contribs, int width) {
+	const int round = 1 << (WEIGHT_BITS - ROW_BITS - 1);
+
+	for (int x = 0; x < width; ++x) {
+		const uint8_t *p = (const uint8_t *) (src + contribs[x].start);
+		const int16_t *w = contribs[x].weights;
+		int c[4] = { round, round, round, round };
+
+		for (int k = 0; k < contribs[x].count; ++k, p += 4) {
+			for (int i = 0; i < 4; ++i)
+				c[i] += w[k] * p[i];
+		}
+
+		for (int i = 0; i < 4; ++i)
+			dst[x * 4 + i] = clamp_row(c[i] >> (WEIGHT_BITS - ROW_BITS));
+	}
+}
+
+static void scale_row_h16_c(const int16_t *src, int16_t *dst, const struct scroll_contrib *contribs, int width) {
+	const int round = 1 << (WEIGHT_BITS - 1);
+
+	for (int x = 0; x < width; ++x) {
+		const int16_t *p = src + contribs[x].start * 4;
+		const int16_t *w = contribs[x].weights;
+		int c[4] = { round, round, round, round };
+
+		for (int k = 0; k < contribs[x].count; ++k, p += 4) {
+			for (int i = 0; i < 4; ++i)
+				c[i] += w[k] * p[i];
+		}
+
+		for (int i = 0; i < 4; ++i)
+			dst[x * 4 + i] = clamp_row(c[i] >> WEIGHT_BITS);
+	}
+}
+
+static void scale_row_v_c(int16_t *const *rows, const int16_t *weights, int count, int width, uint32_t *dst) {
+	const int shift = WEIGHT_BITS + ROW_BITS;
+
+	for (int x = 0; x < width; ++x) {
+		uint8_t *out = (uint8_t *) (dst + x);
+
+		for (int i = 0; i < 4; ++i) {
+			int c = 1 << (shift - 1);
+			for (int k = 0; k < count; ++k)
+				c += weights[k] * rows[k][x * 4 + i];
+			out[i] = clamp_pixel(c >> shift);
+		}
+	}
+}
+
+static void scale_row_v16_c(int16_t *const *rows, const int16_t *weights, int count, int width, int16_t *dst) {
+	for (int x = 0; x < width * 4; ++x) {
+		int c = 1 << (WEIGHT_BITS - 1);
+		for (int k = 0; k < count; ++k)
+			c += weights[k] * rows[k][x];
+		dst[x] = clamp_row(c >> WEIGHT_BITS);
+	}
+}
+
+/* Conversion to the visual's format, blending onto black like Imlib does on a fresh pixmap.
+ * 16 bit formats are dithered with a 4x4 Bayer matrix, scaled to thresholds in [0, 255). */
+static const uint16_t bayer[4][4] = {
+	{ 8, 136, 40, 168 },
+	{ 200, 72, 232, 104 },
+	{ 56, 184, 24, 152 },
+	{ 248, 120, 216, 88 }
+};
+
+typedef void (*pack_row16_fn)(const uint32_t *src, uint16_t *dst, const struct scroll_format *fmt, int width, int y);
+
+/* x / 255 rounded down, exact for x < 65535 */
+static inline uint32_t div255(uint32_t x) {
+	return (x + 1 + (x >> 8)) >> 8;
+}
+
+static void pack_row32(const uint32_t *src, uint32_t *dst, const struct scroll_format *fmt, int width) {
+	for (int x = 0; x < width; ++x) {
+		uint32_t a = src[x] >> 24;
+		uint32_t r = (src[x] >> 16) & 0xff;
+		uint32_t g = (src[x] >> 8) & 0xff;
+		uint32_t b = src[x] & 0xff;
+
+		if (a != 0xff) {
+			r = r * a / 255;
+			g = g * a / 255;
+			b = b * a / 255;
+		}
+
+		dst[x] = (r >> (8 - fmt->red_bits)) << fmt->red_shift |
+			(g >> (8 - fmt->green_bits)) << fmt->green_shift |
+			(b >> (8 - fmt->blue_bits)) << fmt->blue_shift;
+	}
+}
+
+/* src and dst start at a multiple of 4 pixels */
+static void pack_row16_c(const uint32_t *src, uint16_t *dst, const struct scroll_format *fmt, int width, int y) {
+	const uint16_t *t = bayer[y & 3];
+	int red_max = (1 << fmt->red_bits) - 1;
+	int green_max = (1 << fmt->green_bits) - 1;
+	int blue_max = (1 << fmt->blue_bits) - 1;
+
+	for (int x = 0; x < width; ++x) {
+		uint32_t a = src[x] >> 24;
+		uint32_t r = (src[x] >> 16) & 0xff;
+		uint32_t g = (src[x] >> 8) & 0xff;
+		uint32_t b = src[x] & 0xff;
+
+		if (a != 0xff) {
+			r = div255(r * a);
+			g = div255(g * a);
+			b = div255(b * a);
+		}
+
+		dst[x] = div255(r * red_max + t[x & 3]) << fmt->red_shift |
+			div255(g * green_max + t[x & 3]) << fmt->green_shift |
+			div255(b * blue_max + t[x & 3]) << fmt->blue_shift;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+/* Two int16 weights as the multiplier of one madd pair */
+static inline int weight_pair(const int16_t *w) {
+	return (uint16_t) w[0] | (uint32_t) (uint16_t) w[1] << 16;
+}
+
+/* Adds taps [k, count) of a pixel to sum, two at a time */
+__attribute__((target("sse2")))
+static inline __m128i taps_sse2(__m128i sum, const uint32_t *p, const int16_t *w, int k, int count) {
+	const __m128i zero = _mm_setzero_si128();
+
+	for (; k + 2 <= count; k += 2) {
+		/* B0 B1 G0 G1 R0 R1 A0 A1 as int16 */
+		__m128i pair = _mm_unpacklo_epi8(_mm_cvtsi32_si128(p[k]), _mm_cvtsi32_si128(p[k + 1]));
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi8(pair, zero), _mm_set1_epi32(weight_pair(w + k))));
+	}
+
+	if (k < count) {
+		__m128i single = _mm_unpacklo_epi8(_mm_cvtsi32_si128(p[k]), zero);
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi8(single, zero), _mm_set1_epi32((uint16_t) w[k])));
+	}
+
+	return sum;
+}
+
+__attribute__((target("sse2")))
+static inline __m128i taps16_sse2(__m128i sum, const int16_t *p, const int16_t *w, int k, int count) {
+	for (; k + 2 <= count; k += 2) {
+		__m128i a = _mm_loadl_epi64((const __m128i *) (p + k * 4));
+		__m128i b = _mm_loadl_epi64((const __m128i *) (p + k * 4 + 4));
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), _mm_set1_epi32(weight_pair(w + k))));
+	}
+
+	if (k < count) {
+		__m128i a = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *) (p + k * 4)), _mm_setzero_si128());
+		sum = _mm_add_epi32(sum, _mm_madd_epi16(a, _mm_set1_epi32((uint16_t) w[k])));
+	}
+
+	return sum;
+}
+
+__attribute__((target("sse2")))
+static inline void store_row_sse2(int16_t *dst, __m128i sum, int shift) {
+	sum = _mm_sra_epi32(sum, _mm_cvtsi32_si128(shift));
+	sum = _mm_max_epi16(_mm_packs_epi32(sum, sum), _mm_setzero_si128());
+	_mm_storel_epi64((__m128i *) dst, sum);
+}
+
+__attribute__((target("sse2")))
+static void scale_row_h_sse2(const uint32_t *src, int16_t *dst, const struct scroll_contrib *contribs, int width) {
+	const __m128i round = _mm_set1_epi32(1 << (WEIGHT_BITS - ROW_BITS - 1));
+
+	for (int x = 0; x < width; ++x) {
+		__m128i sum = taps_sse2(round, src + contribs[x].start, contribs[x].weights, 0, contribs[x].count);
+		store_row_sse2(dst + x * 4, sum, WEIGHT_BITS - ROW_BITS);
+	}
+}
+
+__attribute__((target("sse2")))
+static void scale_row_h16_sse2(const int16_t *src, int16_t *dst, const struct scroll_contrib *contribs, int width) {
+	const __m128i round = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+
+	for (int x = 0; x < width; ++x) {
+		__m128i sum = taps16_sse2(round, src + contribs[x].start * 4, contribs[x].weights, 0, contribs[x].count);
+		store_row_sse2(dst + x * 4, sum, WEIGHT_BITS);
+	}
+}
+
+/* Four taps per step, one pair in each 128 bit lane */
+__attribute__((target("avx2")))
+static void scale_row_h_avx2(const uint32_t *src, int16_t *dst, const struct scroll_contrib *contribs, int width) {
+	const __m128i round = _mm_set1_epi32(1 << (WEIGHT_BITS - ROW_BITS - 1));
+	const __m128i order = _mm_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15);
+
+	for (int x = 0; x < width; ++x) {
+		const uint32_t *p = src + contribs[x].start;
+		const int16_t *w = contribs[x].weights;
+		int count = contribs[x].count, k = 0;
+		__m256i sum4 = _mm256_setzero_si256();
+
+		for (; k + 4 <= count; k += 4) {
+			__m128i px = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + k)), order);
+			__m256i weights = _mm256_set_m128i(_mm_set1_epi32(weight_pair(w + k + 2)),
+				_mm_set1_epi32(weight_pair(w + k)));
+			sum4 = _mm256_add_epi32(sum4, _mm256_madd_epi16(_mm256_cvtepu8_epi16(px), weights));
+		}
+
+		__m128i sum = _mm_add_epi32(round, _mm_add_epi32(_mm256_castsi256_si128(sum4),
+			_mm256_extracti128_si256(sum4, 1)));
+		store_row_sse2(dst + x * 4, taps_sse2(sum, p, w, k, count), WEIGHT_BITS - ROW_BITS);
+	}
+}
+
+__attribute__((target("avx2")))
+static void scale_row_h16_avx2(const int16_t *src, int16_t *dst, const struct scroll_contrib *contribs, int width) {
+	const __m128i round = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+	const __m256i order = _mm256_broadcastsi128_si256(
+		_mm_setr_epi8(0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15));
+
+	for (int x = 0; x < width; ++x) {
+		const int16_t *p = src + contribs[x].start * 4;
+		const int16_t *w = contribs[x].weights;
+		int count = contribs[x].count, k = 0;
+		__m256i sum4 = _mm256_setzero_si256();
+
+		for (; k + 4 <= count; k += 4) {
+			__m256i px = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) (p + k * 4)), order);
+			__m256i weights = _mm256_set_m128i(_mm_set1_epi32(weight_pair(w + k + 2)),
+				_mm_set1_epi32(weight_pair(w + k)));
+			sum4 = _mm256_add_epi32(sum4, _mm256_madd_epi16(px, weights));
+		}
+
+		__m128i sum = _mm_add_epi32(round, _mm_add_epi32(_mm256_castsi256_si128(sum4),
+			_mm256_extracti128_si256(sum4, 1)));
+		store_row_sse2(dst + x * 4, taps16_sse2(sum, p, w, k, count), WEIGHT_BITS);
+	}
+}
+
+/* Sums of channels [x * 4, x * 4 + 8) over the rows */
+__attribute__((target("sse2")))
+static inline void rows_sse2(int16_t *const *rows, const int16_t *weights, int count, int x, __m128i round,
+	__m128i *lo, __m128i *hi) {
+	*lo = *hi = round;
+	int k = 0;
+
+	for (; k + 2 <= count; k += 2) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (rows[k] + x * 4));
+		__m128i b = _mm_loadu_si128((const __m128i *) (rows[k + 1] + x * 4));
+		__m128i w = _mm_set1_epi32(weight_pair(weights + k));
+		*lo = _mm_add_epi32(*lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+		*hi = _mm_add_epi32(*hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+	}
+
+	if (k < count) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (rows[k] + x * 4));
+		__m128i w = _mm_set1_epi32((uint16_t) weights[k]);
+		*lo = _mm_add_epi32(*lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, _mm_setzero_si128()), w));
+		*hi = _mm_add_epi32(*hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, _mm_setzero_si128()), w));
+	}
+}
+
+/* Same for [x * 4, x * 4 + 16), unpack and pack work within lanes so the order is kept */
+__attribute__((target("avx2")))
+static inline void rows_avx2(int16_t *const *rows, const int16_t *weights, int count, int x, __m256i round,
+	__m256i *lo, __m256i *hi) {
+	*lo = *hi = round;
+	int k = 0;
+
+	for (; k + 2 <= count; k += 2) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) (rows[k] + x * 4));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (rows[k + 1] + x * 4));
+		__m256i w = _mm256_set1_epi32(weight_pair(weights + k));
+		*lo = _mm256_add_epi32(*lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+		*hi = _mm256_add_epi32(*hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+	}
+
+	if (k < count) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) (rows[k] + x * 4));
+		__m256i w = _mm256_set1_epi32((uint16_t) weights[k]);
+		*lo = _mm256_add_epi32(*lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, _mm256_setzero_si256()), w));
+		*hi = _mm256_add_epi32(*hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, _mm256_setzero_si256()), w));
+	}
+}
+
+/* Rows of the tail, for the narrower versions */
+#define TAIL_ROWS(tail, rows, count, x) \
+	int16_t *tail[count]; \
+	for (int k = 0; k < count; ++k) \
+		tail[k] = rows[k] + (x) * 4;
+
+__attribute__((target("sse2")))
+static void scale_row_v_sse2(int16_t *const *rows, const int16_t *weights, int count, int width, uint32_t *dst) {
+	const int shift = WEIGHT_BITS + ROW_BITS;
+	const __m128i round = _mm_set1_epi32(1 << (shift - 1));
+	__m128i lo, hi;
+	int x = 0;
+
+	/* Two pixels per step */
+	for (; x + 2 <= width; x += 2) {
+		rows_sse2(rows, weights, count, x, round, &lo, &hi);
+		__m128i px = _mm_packs_epi32(_mm_srai_epi32(lo, shift), _mm_srai_epi32(hi, shift));
+		_mm_storel_epi64((__m128i *) (dst + x), _mm_packus_epi16(px, px));
+	}
+
+	if (x < width) {
+		TAIL_ROWS(tail, rows, count, x);
+		scale_row_v_c(tail, weights, count, width - x, dst + x);
+	}
+}
+
+__attribute__((target("sse2")))
+static void scale_row_v16_sse2(int16_t *const *rows, const int16_t *weights, int count, int width, int16_t *dst) {
+	const __m128i round = _mm_set1_epi32(1 << (WEIGHT_BITS - 1));
+	__m128i lo, hi;
+	int x = 0;
+
+	for (; x + 2 <= width; x += 2) {
+		rows_sse2(rows, weights, count, x, round, &lo, &hi);
+		__m128i px = _mm_packs_epi32(_mm_srai_epi32(lo, WEIGHT_BITS), _mm_srai_epi32(hi, WEIGHT_BITS));
+		_mm_storeu_si128((__m128i *) (dst + x * 4), _mm_max_epi16(px, _mm_setzero_si128()));
+	}
+
+	if (x < width) {
+		TAIL_ROWS(tail, rows, count, x);
+		scale_row_v16_c(tail, weights, count, width - x, dst + x * 4);
+	}
+}
+
+__attribute__((target("avx2")))
+static void scale_row_v_avx2(int16_t *const *rows, const int16_t *weights, int count, int width, uint32_t *dst) {
+	const int shift = WEIGHT_BITS + ROW_BITS;
+	const __m256i round = _mm256_set1_epi32(1 << (shift - 1));
+	__m256i lo, hi;
+	int x = 0;
+
+	/* Four pixels per step */
+	for (; x + 4 <= width; x += 4) {
+		rows_avx2(rows, weights, count, x, round, &lo, &hi);
+		__m256i px = _mm256_packs_epi32(_mm256_srai_epi32(lo, shift), _mm256_srai_epi32(hi, shift));
+		px = _mm256_permute4x64_epi64(_mm256_packus_epi16(px, px), 0x08);
+		_mm_storeu_si128((__m128i *) (dst + x), _mm256_castsi256_si128(px));
+	}
+
+	if (x < width) {
+		TAIL_ROWS(tail, rows, count, x);
+		scale_row_v_sse2(tail, weights, count, width - x, dst + x);
+	}
+}
+
+__attribute__((target("avx2")))
+static void scale_row_v16_avx2(int16_t *const *rows, const int16_t *weights, int count, int width, int16_t *dst) {
+	const __m256i round = _mm256_set1_epi32(1 << (WEIGHT_BITS - 1));
+	__m256i lo, hi;
+	int x = 0;
+
+	for (; x + 4 <= width; x += 4) {
+		rows_avx2(rows, weights, count, x, round, &lo, &hi);
+		__m256i px = _mm256_packs_epi32(_mm256_srai_epi32(lo, WEIGHT_BITS), _mm256_srai_epi32(hi, WEIGHT_BITS));
+		_mm256_storeu_si256((__m256i *) (dst + x * 4), _mm256_max_epi16(px, _mm256_setzero_si256()));
+	}
+
+	if (x < width) {
+		TAIL_ROWS(tail, rows, count, x);
+		scale_row_v16_sse2(tail, weights, count, width - x, dst + x * 4);
+	}
+}
+
+/* One channel of 8 pixels as int16 */
+__attribute__((target("sse2")))
+static inline __m128i channel_sse2(__m128i lo, __m128i hi, int shift) {
+	const __m128i mask = _mm_set1_epi32(0xff);
+	return _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(lo, shift), mask),
+		_mm_and_si128(_mm_srli_epi32(hi, shift), mask));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i div255_sse2(__m128i x) {
+	return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(x, _mm_set1_epi16(1)), _mm_srli_epi16(x, 8)), 8);
+}
+
+/* Blends and dithers one channel, the products fit 16 bits unsigned */
+__attribute__((target("sse2")))
+static inline __m128i dither_sse2(__m128i c, __m128i a, __m128i max, __m128i threshold, __m128i shift) {
+	c = div255_sse2(_mm_mullo_epi16(c, a));
+	c = div255_sse2(_mm_add_epi16(_mm_mullo_epi16(c, max), threshold));
+	return _mm_sll_epi16(c, shift);
+}
+
+__attribute__((target("sse2")))
+static void pack_row16_sse2(const uint32_t *src, uint16_t *dst, const struct scroll_format *fmt, int width, int y) {
+	const uint16_t *t = bayer[y & 3];
+	const __m128i threshold = _mm_setr_epi16(t[0], t[1], t[2], t[3], t[0], t[1], t[2], t[3]);
+	const __m128i red_max = _mm_set1_epi16((1 << fmt->red_bits) - 1);
+	const __m128i green_max = _mm_set1_epi16((1 << fmt->green_bits) - 1);
+	const __m128i blue_max = _mm_set1_epi16((1 << fmt->blue_bits) - 1);
+	const __m128i red_shift = _mm_cvtsi32_si128(fmt->red_shift);
+	const __m128i green_shift = _mm_cvtsi32_si128(fmt->green_shift);
+	const __m128i blue_shift = _mm_cvtsi32_si128(fmt->blue_shift);
+	int x = 0;
+
+	for (; x + 8 <= width; x += 8) {
+		__m128i lo = _mm_loadu_si128((const __m128i *) (src + x));
+		__m128i hi = _mm_loadu_si128((const __m128i *) (src + x + 4));
+		__m128i a = channel_sse2(lo, hi, 24);
+
+		__m128i px = _mm_or_si128(dither_sse2(channel_sse2(lo, hi, 16), a, red_max, threshold, red_shift),
+			_mm_or_si128(dither_sse2(channel_sse2(lo, hi, 8), a, green_max, threshold, green_shift),
+				dither_sse2(channel_sse2(lo, hi, 0), a, blue_max, threshold, blue_shift)));
+		_mm_storeu_si128((__m128i *) (dst + x), px);
+	}
+
+	pack_row16_c(src + x, dst + x, fmt, width - x, y);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i channel_avx2(__m256i lo, __m256i hi, int shift) {
+	const __m256i mask = _mm256_set1_epi32(0xff);
+	return _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(lo, shift), mask),
+		_mm256_and_si256(_mm256_srli_epi32(hi, shift), mask));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i div255_avx2(__m256i x) {
+	return _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(x, _mm256_set1_epi16(1)),
+		_mm256_srli_epi16(x, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i dither_avx2(__m256i c, __m256i a, __m256i max, __m256i threshold, __m128i shift) {
+	c = div255_avx2(_mm256_mullo_epi16(c, a));
+	c = div255_avx2(_mm256_add_epi16(_mm256_mullo_epi16(c, max), threshold));
+	return _mm256_sll_epi16(c, shift);
+}
+
+/* Packing works within lanes, which swaps the middle groups of 4 pixels. Every group uses the same
+ * thresholds, so only the result needs to be put back in order. */
+__attribute__((target("avx2")))
+static void pack_row16_avx2(const uint32_t *src, uint16_t *dst, const struct scroll_format *fmt, int width, int y) {
+	const uint16_t *t = bayer[y & 3];
+	const __m256i threshold = _mm256_setr_epi16(t[0], t[1], t[2], t[3], t[0], t[1], t[2], t[3],
+		t[0], t[1], t[2], t[3], t[0], t[1], t[2], t[3]);
+	const __m256i red_max = _mm256_set1_epi16((1 << fmt->red_bits) - 1);
+	const __m256i green_max = _mm256_set1_epi16((1 << fmt->green_bits) - 1);
+	const __m256i blue_max = _mm256_set1_epi16((1 << fmt->blue_bits) - 1);
+	const __m128i red_shift = _mm_cvtsi32_si128(fmt->red_shift);
+	const __m128i green_shift = _mm_cvtsi32_si128(fmt->green_shift);
+	const __m128i blue_shift = _mm_cvtsi32_si128(fmt->blue_shift);
+	int x = 0;
+
+	for (; x + 16 <= width; x += 16) {
+		__m256i lo = _mm256_loadu_si256((const __m256i *) (src + x));
+		__m256i hi = _mm256_loadu_si256((const __m256i *) (src + x + 8));
+		__m256i a = channel_avx2(lo, hi, 24);
+
+		__m256i px = _mm256_or_si256(dither_avx2(channel_avx2(lo, hi, 16), a, red_max, threshold, red_shift),
+			_mm256_or_si256(dither_avx2(channel_avx2(lo, hi, 8), a, green_max, threshold, green_shift),
+				dither_avx2(channel_avx2(lo, hi, 0), a, blue_max, threshold, blue_shift)));
+		_mm256_storeu_si256((__m256i *) (dst + x), _mm256_permute4x64_epi64(px, 0xd8));
+	}
+
+	pack_row16_sse2(src + x, dst + x, fmt, width - x, y);
+}
+#endif
+
+static scale_row_h_fn scale_row_h = scale_row_h_c;
+static scale_row_h16_fn scale_row_h16 = scale_row_h16_c;
+static scale_row_v_fn scale_row_v = scale_row_v_c;
+static scale_row_v16_fn scale_row_v16 = scale_row_v16_c;
+static pack_row16_fn pack_row16 = pack_row16_c;
+static pthread_once_t scale_once = PTHREAD_ONCE_INIT;
+
+
+/* Linear light. The sRGB channels are mapped to 8.7 fixed point linear values, alpha just shifted.
+ * Going back, the top 12 bits index a table, which maps all 256 values back to themselves.
+ * There is a table for each byte of a pixel so the loops don't need to check for alpha. */
+#define LINEAR_MAX (255 << ROW_BITS)
+#define SRGB_BITS 12
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define ALPHA_BYTE 3
+#else
+#define ALPHA_BYTE 0
+#endif
+
+static int16_t to_linear[4][256];
+static uint8_t to_srgb[4][1 << SRGB_BITS];
+
+static void scroll_linear_init(void) {
+	const int step = 1 << (15 - SRGB_BITS);
+
+	for (int i = 0; i < 256; ++i) {
+		double c = i / 255.0;
+		c = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+		for (int j = 0; j < 4; ++j)
+			to_linear[j][i] = j == ALPHA_BYTE ? i << ROW_BITS : lround(c * LINEAR_MAX);
+	}
+
+	/* Each entry covers a range of linear values, use its center */
+	for (int i = 0; i < 1 << SRGB_BITS; ++i) {
+		double l = (i * step + step / 2.0 - 0.5) / LINEAR_MAX;
+		l = l < 0 ? 0 : l > 1 ? 1 : l;
+		l = l <= 0.0031308 ? l * 12.92 : 1.055 * pow(l, 1 / 2.4) - 0.055;
+		for (int j = 0; j < 4; ++j)
+			to_srgb[j][i] = j == ALPHA_BYTE ? clamp_pixel((i * step + (1 << (ROW_BITS - 1))) >> ROW_BITS) : lround(l * 255);
+	}
+}
+
+static void linear_row(const uint32_t *src, int16_t *dst, int width) {
+	const uint8_t *p = (const uint8_t *) src;
+
+	for (int x = 0; x < width * 4; x += 4) {
+		dst[x] = to_linear[0][p[x]];
+		dst[x + 1] = to_linear[1][p[x + 1]];
+		dst[x + 2] = to_linear[2][p[x + 2]];
+		dst[x + 3] = to_linear[3][p[x + 3]];
+	}
+}
+
+static void srgb_row(const int16_t *src, uint32_t *dst, int width) {
+	const int shift = 15 - SRGB_BITS;
+	uint8_t *out = (uint8_t *) dst;
+
+	for (int x = 0; x < width * 4; x += 4) {
+		out[x] = to_srgb[0][src[x] >> shift];
+		out[x + 1] = to_srgb[1][src[x + 1] >> shift];
+		out[x + 2] = to_srgb[2][src[x + 2] >> shift];
+		out[x + 3] = to_srgb[3][src[x + 3] >> shift];
+	}
+}
+
+/* Picks the best passes for this CPU, SCROLL_SIMD=c, sse2 or avx2 limits the choice */
+static void scroll_scale_init(void) {
+	const char *simd = getenv("SCROLL_SIMD");
+	const char *name = "c";
+
+	scroll_linear_init();
+
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	int max = simd && !strcmp(simd, "c") ? 0 : simd && !strcmp(simd, "sse2") ? 1 : 2;
+
+	if (max >= 2 && __builtin_cpu_supports("avx2")) {
+		scale_row_h = scale_row_h_avx2;
+		scale_row_h16 = scale_row_h16_avx2;
+		scale_row_v = scale_row_v_avx2;
+		scale_row_v16 = scale_row_v16_avx2;
+		pack_row16 = pack_row16_avx2;
+		name = "avx2";
+	} else if (max >= 1 && __builtin_cpu_supports("sse2")) {
+		scale_row_h = scale_row_h_sse2;
+		scale_row_h16 = scale_row_h16_sse2;
+		scale_row_v = scale_row_v_sse2;
+		scale_row_v16 = scale_row_v16_sse2;
+		pack_row16 = pack_row16_sse2;
+		name = "sse2";
+	}
+#else
+	(void) simd;
+#endif
+
+	_verbose("Scaling with %s passes", name);
+}
+
+/* Output rows [y0, y1) of one scaling pass */
+struct scroll_scale_band {
+	pthread_t thread;
+	const struct scroll_image *src;
+	const struct scroll_format *fmt;
+	struct scroll_scaled *dst;
+	const struct scroll_contrib *contribs_h, *contribs_v;
+	int max_v;
+	int linear;
+	int y0, y1;
+};
+
+/* Filters each source row of the band only once */
+static void *scroll_scale_band(void *data) {
+	struct scroll_scale_band *band = data;
+	scroll_prof_thread();
+	const struct scroll_image *src = band->src;
+	struct scroll_scaled *dst = band->dst;
+	int max_v = band->max_v;
+	struct scroll_perf_sample perf;
+	scroll_perf_begin(&perf);
+
+	/* Ring of horizontally filtered rows covering the largest vertical window */
+	int row_size = dst->width * 4;
+	int16_t *ring = malloc(sizeof(int16_t) * row_size * max_v);
+	int16_t **rows = malloc(sizeof(int16_t *) * max_v);
+	uint32_t *line = malloc(sizeof(uint32_t) * dst->width);
+	_check_or_die(ring && rows && line, "Failed to allocate scaling buffers");
+
+	/* Linear light source row and output row */
+	int16_t *linear_src = NULL, *linear_dst = NULL;
+	if (band->linear) {
+		linear_src = malloc(sizeof(int16_t) * src->width * 4);
+		linear_dst = malloc(sizeof(int16_t) * row_size);
+		_check_or_die(linear_src && linear_dst, "Failed to allocate scaling buffers");
+	}
+
+	int next_row = 0;
+	for (int y = band->y0; y < band->y1; ++y) {
+		int first = band->contribs_v[y].start;
+		int last = first + band->contribs_v[y].count;
+
+		if (next_row < first)
+			next_row = first;
+
+		for (; next_row < last; ++next_row) {
+			const uint32_t *row = src->pixels + (size_t) next_row * src->width;
+			int16_t *out = ring + (next_row % max_v) * row_size;
+
+			if (band->linear) {
+				linear_row(row, linear_src, src->width);
+				scale_row_h16(linear_src, out, band->contribs_h, dst->width);
+			} else {
+				scale_row_h(row, out, band->contribs_h, dst->width);
+			}
+		}
+
+		for (int k = 0; k < band->contribs_v[y].count; ++k)
+			rows[k] = ring + ((first + k) % max_v) * row_size;
+
+		const struct scroll_contrib *contrib = &band->contribs_v[y];
+		if (band->linear) {
+			scale_row_v16(rows, contrib->weights, contrib->count, dst->width, linear_dst);
+			srgb_row(linear_dst, line, dst->width);
+		} else {
+			scale_row_v(rows, contrib->weights, contrib->count, dst->width, line);
+		}
+		char *out = dst->data + (size_t) y * dst->stride;
+		if (band->fmt->bytes_per_pixel == 4)
+			pack_row32(line, (uint32_t *) out, band->fmt, dst->width);
+		else
+			pack_row16(line, (uint16_t *) out, band->fmt, dst->width, y);
+	}
+
+	free(linear_dst);
+	free(linear_src);
+	free(line);
+	free(rows);
+	free(ring);
+	scroll_perf_end(&perf, PERF_SCALE);
+	return NULL;
+}
+
+/* Scales to dst->width x dst->height, splitting the rows across the CPUs.
+ * With linear set, the filter works on linear light instead of sRGB values. */
+void scroll_scale(const struct scroll_image *src, const struct scroll_format *fmt, enum scroll_filter filter,
+	int linear, struct scroll_scaled *dst) {
+	pthread_once(&scale_once, scroll_scale_init);
+
+	int max_h, max_v;
+	struct scroll_contrib *contribs_h = scroll_contribs(src->width, dst->width, filter, &max_h);
+	struct scroll_contrib *contribs_v = scroll_contribs(src->height, dst->height, filter, &max_v);
+
+	dst->stride = (dst->width * fmt->bytes_per_pixel + 3) & ~3;
+	dst->data = malloc((size_t) dst->stride * dst->height);
+	_check_or_die(dst->data, "Failed to allocate %dx%d scaled image", dst->width, dst->height);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int num_bands = MAX(1, MIN(MIN(cpus, dst->height / SCALE_BAND_ROWS), SCALE_MAX_BANDS));
+	struct scroll_scale_band bands[SCALE_MAX_BANDS];
+
+	for (int i = 0; i < num_bands; ++i) {
+		bands[i] = (struct scroll_scale_band) {
+			0,
+			src, fmt, dst,
+			contribs_h, contribs_v,
+			max_v,
+			linear,
+			(long) dst->height * i / num_bands,
+			(long) dst->height * (i + 1) / num_bands
+		};
+	}
+
+	/* The first band runs on the calling thread, bands without a thread as well */
+	int started[SCALE_MAX_BANDS] = { 0 };
+	for (int i = 1; i < num_bands; ++i)
+		started[i] = !pthread_create(&bands[i].thread, NULL, scroll_scale_band, &bands[i]);
+
+	scroll_scale_band(&bands[0]);
+	for (int i = 1; i < num_bands; ++i) {
+		if (started[i])
+			pthread_join(bands[i].thread, NULL);
+		else
+			scroll_scale_band(&bands[i]);
+	}
+
+	scroll_contribs_free(contribs_v);
+	scroll_contribs_free(contribs_h);
+}
+
+void scroll_scaled_put(Display *display, Visual *visual, int depth, Drawable drw, GC gc,
+	const struct scroll_scaled *scaled) {
+	XImage *img = XCreateImage(display, visual, depth, ZPixmap, 0, scaled->data,
+		scaled->width, scaled->height, 32, scaled->stride);
+	_check_or_die(img, "Failed to create image for upload");
+
+	/* The data is in host byte order, Xlib swaps it if the server differs */
+	img->byte_order = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? LSBFirst : MSBFirst;
+
+	XPutImage(display, drw, gc, img, 0, 0, 0, 0, scaled->width, scaled->height);
+
+	img->data = NULL;
+	XDestroyImage(img);
+}
+
+void scroll_scaled_free(struct scroll_scaled *scaled) {
+	free(scaled->data);
+	scaled->data = NULL;
+}
+
+
+/* Batches */
+static void scroll_scale_job_free(struct scroll_scale_job *job) {
+	scroll_scaled_free(&job->out);
+	if (job->batch->budget)
+		scroll_budget_sub(job->batch->budget, BUDGET_SCALED, job->bytes);
+	job->bytes = 0;
+}
+
+static void *scroll_scale_thread(void *data) {
+	struct scroll_scale_job *job = data;
+	scroll_prof_thread();
+	struct scroll_scale_batch *batch = job->batch;
+
+	/* Waits for uploaded images to be released when the budget is tight */
+	if (batch->budget) {
+		job->bytes = (size_t) ((job->out.width * batch->fmt->bytes_per_pixel + 3) & ~3) * job->out.height;
+		if (!scroll_budget_reserve(batch->budget, BUDGET_SCALED, job->bytes))
+			_warn("Scaling to %dx%d exceeds the memory budget", job->out.width, job->out.height);
+	}
+
+	int start = millis();
+	int64_t trace = scroll_trace_now();
+	scroll_scale(batch->src, batch->fmt, batch->filter, batch->linear, &job->out);
+	scroll_trace_span("scale", trace, scroll_trace_now(), job->out.width);
+	int end = millis();
+
+	pthread_mutex_lock(&batch->lock);
+	job->millis = end - start;
+	job->done = 1;
+	job->storing = batch->on_done != NULL;
+	pthread_cond_signal(&batch->cond);
+	pthread_mutex_unlock(&batch->lock);
+
+	/* Slow work like writing the cache doesn't hold up the upload */
+	if (batch->on_done) {
+		batch->on_done(job, batch->data);
+
+		pthread_mutex_lock(&batch->lock);
+		job->storing = 0;
+		int release = job->released;
+		pthread_mutex_unlock(&batch->lock);
+
+		if (release)
+			scroll_scale_job_free(job);
+	}
+
+	return NULL;
+}
+
+/* Starts one thread per size, sizes holds width and height pairs */
+void scroll_scale_batch_start(struct scroll_scale_batch *batch, const struct scroll_image *src,
+	const struct scroll_format *fmt, enum scroll_filter filter, int linear, struct scroll_budget *budget,
+	const int *sizes, int num_sizes, void (*on_done)(struct scroll_scale_job *job, void *data), void *data) {
+	batch->src = src;
+	batch->fmt = fmt;
+	batch->filter = filter;
+	batch->linear = linear;
+	batch->budget = budget;
+	batch->on_done = on_done;
+	batch->data = data;
+	batch->num_jobs = num_sizes;
+	batch->num_returned = 0;
+	batch->jobs = calloc(num_sizes, sizeof(struct scroll_scale_job));
+	_check_or_die(batch->jobs, "Failed to allocate scaling jobs");
+
+	pthread_mutex_init(&batch->lock, NULL);
+	pthread_cond_init(&batch->cond, NULL);
+
+	for (int i = 0; i < num_sizes; ++i) {
+		struct scroll_scale_job *job = &batch->jobs[i];
+		job->batch = batch;
+		job->index = i;
+		job->out.width = sizes[i * 2];
+		job->out.height = sizes[i * 2 + 1];
+
+		_check_or_die(!pthread_create(&job->thread, NULL, scroll_scale_thread, job),
+			"Failed to start scaling thread");
+	}
+}
+
+/* Returns jobs in the order they finish, NULL once all have been returned */
+struct scroll_scale_job *scroll_scale_batch_next(struct scroll_scale_batch *batch) {
+	struct scroll_scale_job *res = NULL;
+
+	pthread_mutex_lock(&batch->lock);
+	while (!res && batch->num_returned < batch->num_jobs) {
+		for (int i = 0; i < batch->num_jobs; ++i) {
+			if (batch->jobs[i].done && !batch->jobs[i].returned) {
+				res = &batch->jobs[i];
+				res->returned = 1;
+				++batch->num_returned;
+				break;
+			}
+		}
+
+		if (!res)
+			pthread_cond_wait(&batch->cond, &batch->lock);
+	}
+	pthread_mutex_unlock(&batch->lock);
+
+	return res;
+}
+
+/* Frees a returned job's image once it has been uploaded, letting waiting jobs continue.
+ * While on_done still reads the image, the worker frees it when that returns. */
+void scroll_scale_job_release(struct scroll_scale_job *job) {
+	pthread_mutex_lock(&job->batch->lock);
+	job->released = 1;
+	int storing = job->storing;
+	pthread_mutex_unlock(&job->batch->lock);
+
+	if (!storing)
+		scroll_scale_job_free(job);
+}
+
+void scroll_scale_batch_free(struct scroll_scale_batch *batch) {
+	for (int i = 0; i < batch->num_jobs; ++i) {
+		pthread_join(batch->jobs[i].thread, NULL);
+		scroll_scale_job_release(&batch->jobs[i]);
+	}
+
+	free(batch->jobs);
+	pthread_mutex_destroy(&batch->lock);
+	pthread_cond_destroy(&batch->cond);
+}
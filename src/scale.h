@@ -0,0 +1,85 @@
+#ifndef __scale_h__
+#define __scale_h__
+
+#include <pthread.h>
+
+#include <X11/Xlib.h>
+
+#include "budget.h"
+#include "image.h"
+
+/* Pixel layout of a TrueColor visual */
+struct scroll_format {
+	int bytes_per_pixel;
+	int red_shift, green_shift, blue_shift;
+	int red_bits, green_bits, blue_bits;
+};
+
+enum scroll_filter {
+	FILTER_BOX = 0,
+	FILTER_BILINEAR,
+	FILTER_LANCZOS3,
+	FILTER_END
+};
+
+/* Scaled image in the format of the X visual, ready for XPutImage */
+struct scroll_scaled {
+	int width, height;
+	int stride;
+	char *data;
+};
+
+struct scroll_scale_batch;
+
+struct scroll_scale_job {
+	struct scroll_scale_batch *batch;
+	int index;
+	pthread_t thread;
+	struct scroll_scaled out;
+	/* Counted against the budget until released */
+	size_t bytes;
+	int done;
+	int returned;
+	/* The image is freed by whichever of on_done and the release comes last */
+	int storing;
+	int released;
+	int millis;
+};
+
+/* Scales a source image to several sizes concurrently */
+struct scroll_scale_batch {
+	const struct scroll_image *src;
+	const struct scroll_format *fmt;
+	enum scroll_filter filter;
+	int linear;
+	/* Jobs wait for memory when set */
+	struct scroll_budget *budget;
+	struct scroll_scale_job *jobs;
+	int num_jobs;
+	int num_returned;
+	/* Called on the worker thread once a job is scaled and returned, may overlap the upload */
+	void (*on_done)(struct scroll_scale_job *job, void *data);
+	void *data;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+int scroll_depth_bpp(Display *display, int depth);
+int scroll_format_init(struct scroll_format *fmt, Display *display, Visual *visual, int depth);
+int scroll_filter_parse(const char *name);
+const char *scroll_filter_name(enum scroll_filter filter);
+
+void scroll_scale(const struct scroll_image *src, const struct scroll_format *fmt, enum scroll_filter filter,
+	int linear, struct scroll_scaled *dst);
+void scroll_scaled_put(Display *display, Visual *visual, int depth, Drawable drw, GC gc,
+	const struct scroll_scaled *scaled);
+void scroll_scaled_free(struct scroll_scaled *scaled);
+
+void scroll_scale_batch_start(struct scroll_scale_batch *batch, const struct scroll_image *src,
+	const struct scroll_format *fmt, enum scroll_filter filter, int linear, struct scroll_budget *budget,
+	const int *sizes, int num_sizes, void (*on_done)(struct scroll_scale_job *job, void *data), void *data);
+struct scroll_scale_job *scroll_scale_batch_next(struct scroll_scale_batch *batch);
+void scroll_scale_job_release(struct scroll_scale_job *job);
+void scroll_scale_batch_free(struct scroll_scale_batch *batch);
+
+#endif
@@ -1,5 +1,10 @@
 #include <errno.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,11 +17,32 @@
 #ifdef XINERAMA
 #include <X11/extensions/Xinerama.h>
 #endif
+#ifdef XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
+#ifdef XRES
+#include <X11/extensions/XRes.h>
+#endif
 
 #include <Imlib2.h>
 #include <sys/types.h>
 
+#include "alloc.h"
+#include "budget.h"
+#include "cache.h"
+#include "hist.h"
+#include "image.h"
+#include "loop.h"
+#include "metrics.h"
+#include "perf.h"
+#include "power.h"
+#include "probes.h"
+#include "prof.h"
+#include "scale.h"
+#include "status.h"
+#include "trace.h"
 #include "utils.h"
+#include "xstats.h"
 
 
 struct scroll_vec {
@@ -27,12 +53,28 @@ struct scroll_vec {
 	R.x = A.x + (B.x - A.x) / 2; \
 	R.y = A.y + (B.y - A.y) / 2;
 
+struct scroll_rect {
+	int x, y;
+	int width, height;
+};
+
+/* Server-side copy of the scaled image, shared by screens of the same image size */
+struct scroll_pixmap {
+	Pixmap pixmap;
+	int width, height;
+	int refs;
+	struct scroll_pixmap *next;
+	/* Holds an upscaled preview until the full quality image is ready */
+	int preview;
+};
+
 struct scroll_screen {
 	int x, y;
 	int width, height;
 	Window window;
 	Window image_window;
 	int image_width, image_height;
+	struct scroll_pixmap *pixmap;
 };
 
 enum scroll_scaling_modes {
@@ -49,6 +91,19 @@ struct scroll_x11 {
 	GC gc;
 	Colormap colormap;
 	int depth;
+	int width, height;
+	struct scroll_format format;
+	int has_format;
+	/* Bits per pixel of the pixmaps, and at the default depth when they use a 16 bit visual instead */
+	int bpp;
+	int full_bpp;
+	int has_xres;
+	int randr_event_base;
+	int randr_monitors;
+	int screens_changed;
+	int screen_updates;
+	/* Protocol traffic of the frames */
+	struct scroll_xstats stats;
 };
 
 struct scroll_opts {
@@ -61,6 +116,23 @@ struct scroll_opts {
 	int bezier;
 	int bezier_res;
 	int fps;
+	int battery_fps;
+	int cache;
+	int handoff;
+	int preview;
+	enum scroll_filter filter;
+	int linear;
+	int reduced;
+	size_t mem_budget;
+	char *trace;
+	char *metrics;
+	int metrics_port;
+	int perf;
+	char *profile;
+	int profile_hz;
+	int alloc_check;
+	char *status;
+	int journal;
 };
 
 struct scroll_anim {
@@ -73,22 +145,108 @@ struct scroll_anim {
 	double cur_travel_time;
 };
 
+/* State published by the previous instance, see scroll_handoff_adopt */
+struct scroll_handoff {
+	int valid;
+	uint64_t path_hash;
+	int cur_point;
+	int cur_time;
+};
+
+/* Screens waiting for an image size to be scaled, see scroll_on_scaled */
+struct scroll_prepare {
+	struct scroll_ctx *ctx;
+	struct scroll_rect *rects;
+	int *pending;
+	int num_rects;
+};
+
+/* Full quality images scaled in the background while the screens show previews */
+struct scroll_refine {
+	int running;
+	int threaded;
+	pthread_t thread;
+	int event_fd;
+	int ok;
+	int start;
+	struct scroll_prepare prep;
+	int *sizes;
+	int num_sizes;
+	struct scroll_scale_batch batch;
+};
+
+enum scroll_frame_metric {
+	/* From the timer expiring to handling it */
+	FRAME_LATENESS = 0,
+	FRAME_STEP,
+	FRAME_DRAW,
+	/* Until the server processed the moves */
+	FRAME_COMPLETE,
+	FRAME_INTERVAL,
+	FRAME_END
+};
+
+static const char *frame_metric_names[FRAME_END] = { "lateness", "step", "draw", "complete", "interval" };
+
+/* Frame times in microseconds, printed on SIGUSR1 */
+struct scroll_frame_stats {
+	struct scroll_hist hists[FRAME_END];
+	uint64_t frames;
+	/* Timer expirations without a frame of their own */
+	uint64_t dropped;
+	/* Frames which took longer than the frame period */
+	uint64_t overrun;
+};
+
+struct scroll_timing {
+	int fps;
+	int last;
+	int frame_timer;
+	int power_timer;
+	/* Timer interval and next expiry in nanoseconds, so the deadline doesn't drift from the timer */
+	int64_t interval;
+	int64_t deadline;
+	/* Start of the last frame in microseconds, 0 after a rate change */
+	int64_t last_start;
+	struct scroll_frame_stats stats;
+	/* Of the slowest image in the last batch */
+	int scale_millis;
+};
+
 struct scroll_ctx {
 	struct scroll_x11 x11;
 
 	struct scroll_screen **screens;
 	int num_screens;
+	struct scroll_pixmap *pixmaps;
 
 	struct scroll_anim anim;
 
-	Imlib_Image image;
+	struct scroll_image image;
+	struct scroll_loader loader;
+	struct scroll_budget budget;
+	int source_width, source_height;
+
+	struct scroll_cache_key cache_key;
+	int has_cache;
+	uint64_t image_hash;
+
+	struct scroll_handoff handoff;
+	struct scroll_refine refine;
 
 	struct scroll_opts opts;
+
+	struct scroll_loop loop;
+	struct scroll_timing timing;
+	int signal_fd;
+	struct scroll_metrics metrics;
+	struct scroll_status_writer status;
 };
 
 struct scroll_ctx *scroll_init_ctx(struct scroll_ctx *ctx) {
 	ctx->screens = NULL;
 	ctx->num_screens = 0;
+	ctx->pixmaps = NULL;
 
 	ctx->anim = (struct scroll_anim) {
 		NULL,
@@ -100,7 +258,14 @@ struct scroll_ctx *scroll_init_ctx(struct scroll_ctx *ctx) {
 		1.0
 	};
 
-	ctx->image = NULL;
+	memset(&ctx->image, 0, sizeof(ctx->image));
+	ctx->source_width = 0;
+	ctx->source_height = 0;
+	ctx->has_cache = 0;
+	ctx->image_hash = 0;
+	ctx->handoff.valid = 0;
+	ctx->refine.running = 0;
+	ctx->refine.event_fd = -1;
 
 	ctx->opts = (struct scroll_opts) {
 		NULL,
@@ -112,19 +277,44 @@ struct scroll_ctx *scroll_init_ctx(struct scroll_ctx *ctx) {
 		0,
 		15,
 		60,
+		-1,
+		1,
+		0,
+		1,
+		FILTER_BILINEAR,
+		1,
+		0,
+		0,
+		NULL,
+		NULL,
+		0,
+		0,
+		NULL,
+		PROF_DEFAULT_HZ,
+		0,
+		NULL,
+		0,
 	};
 
+	ctx->timing = (struct scroll_timing) {
+		0,
+		0,
+		-1,
+		-1,
+		0,
+		0,
+		0,
+	};
+	ctx->signal_fd = -1;
+	ctx->status.page = NULL;
+
 	return ctx;
 }
 
 
-/* Helpers */
-static int millis(void) {
-	struct timespec spec;
-	clock_gettime(CLOCK_MONOTONIC, &spec);
-	return spec.tv_sec * 1000 + spec.tv_nsec / 1000000;
-}
+int scroll_verbose = 0;
 
+/* Helpers */
 void image_to_drawable(Drawable drw, Imlib_Image img, int x, int y, int w, int h,
 	char dither, char blend, char alias) {
 	imlib_context_set_image(img);
@@ -137,14 +327,153 @@ void image_to_drawable(Drawable drw, Imlib_Image img, int x, int y, int w, int h
 }
 
 
+/* Size of the scaled image for a screen of the given size */
+void scroll_image_size(struct scroll_ctx *ctx, int width, int height, int *image_width, int *image_height) {
+	int buf;
+	double scale;
+
+	switch (ctx->opts.scaling_mode) {
+	case SCALE_FIT_VERT:
+		buf = height * ctx->opts.scale;
+		scale = (double)buf / ctx->source_height;
+		*image_width = ctx->source_width * scale;
+		*image_height = buf;
+		break;
+	case SCALE_FIT_HORIZ:
+		buf = width * ctx->opts.scale;
+		scale = (double)buf / ctx->source_width;
+		*image_width = buf;
+		*image_height = ctx->source_height * scale;
+		break;
+	case SCALE_STRETCH:
+	default:
+		*image_width = width * ctx->opts.scale;
+		*image_height = height * ctx->opts.scale;
+		break;
+	}
+}
+
+static size_t scroll_pixmap_bytes(struct scroll_ctx *ctx, struct scroll_pixmap *pixmap) {
+	return (size_t) pixmap->width * pixmap->height * ctx->x11.bpp / 8;
+}
+
+/* Adds an unreferenced pixmap of the given size, the caller draws the image into it */
+struct scroll_pixmap *scroll_new_pixmap(struct scroll_ctx *ctx, int width, int height) {
+	struct scroll_pixmap *res = malloc(sizeof(struct scroll_pixmap));
+	res->width = width;
+	res->height = height;
+	res->refs = 0;
+	res->preview = 0;
+
+	res->pixmap = XCreatePixmap(ctx->x11.display, ctx->x11.root, width, height, ctx->x11.depth);
+	_check_or_die(res->pixmap, "Failed to create pixmap");
+	scroll_budget_add(&ctx->budget, BUDGET_PIXMAPS, scroll_pixmap_bytes(ctx, res));
+
+	res->next = ctx->pixmaps;
+	ctx->pixmaps = res;
+
+	return res;
+}
+
+struct scroll_pixmap *scroll_find_pixmap(struct scroll_ctx *ctx, int width, int height) {
+	for (struct scroll_pixmap *res = ctx->pixmaps; res; res = res->next) {
+		if (res->width == width && res->height == height)
+			return res;
+	}
+	return NULL;
+}
+
+/* Returns a pixmap holding the image at the given size, rendering it only if no screen has one yet */
+struct scroll_pixmap *scroll_get_pixmap(struct scroll_ctx *ctx, int width, int height) {
+	struct scroll_pixmap *res = scroll_find_pixmap(ctx, width, height);
+
+	if (res) {
+		_debug("Reusing pixmap with size (%d; %d)", width, height);
+		++res->refs;
+		return res;
+	}
+
+	res = scroll_new_pixmap(ctx, width, height);
+	res->refs = 1;
+
+	/* Draw image to pixmap */
+	if (ctx->x11.has_format) {
+		struct scroll_scaled scaled = { width, height, 0, NULL };
+		scroll_scale(&ctx->image, &ctx->x11.format, ctx->opts.filter, ctx->opts.linear, &scaled);
+		scroll_scaled_put(ctx->x11.display, ctx->x11.visual, ctx->x11.depth,
+			res->pixmap, ctx->x11.gc, &scaled);
+		scroll_scaled_free(&scaled);
+	} else if (ctx->image.handle) {
+		image_to_drawable(res->pixmap, ctx->image.handle, 0, 0, width, height, 1, 1, 1);
+	} else {
+		/* Decoded without Imlib, wrap the pixels without copying them */
+		Imlib_Image img = imlib_create_image_using_data(ctx->image.width, ctx->image.height,
+			(DATA32 *) ctx->image.pixels);
+		image_to_drawable(res->pixmap, img, 0, 0, width, height, 1, 1, 1);
+		imlib_context_set_image(img);
+		imlib_free_image();
+	}
+
+	return res;
+}
+
+void scroll_release_pixmap(struct scroll_ctx *ctx, struct scroll_pixmap *pixmap) {
+	if (--pixmap->refs)
+		return;
+
+	struct scroll_pixmap **p = &ctx->pixmaps;
+	while (*p != pixmap)
+		p = &(*p)->next;
+	*p = pixmap->next;
+
+	scroll_budget_sub(&ctx->budget, BUDGET_PIXMAPS, scroll_pixmap_bytes(ctx, pixmap));
+	XFreePixmap(ctx->x11.display, pixmap->pixmap);
+	free(pixmap);
+}
+
+/* Free pixmaps which were prepared but ended up unused */
+void scroll_sweep_pixmaps(struct scroll_ctx *ctx) {
+	struct scroll_pixmap **p = &ctx->pixmaps;
+
+	while (*p) {
+		struct scroll_pixmap *pixmap = *p;
+
+		if (pixmap->refs) {
+			p = &pixmap->next;
+			continue;
+		}
+
+		*p = pixmap->next;
+		scroll_budget_sub(&ctx->budget, BUDGET_PIXMAPS, scroll_pixmap_bytes(ctx, pixmap));
+		XFreePixmap(ctx->x11.display, pixmap->pixmap);
+		free(pixmap);
+	}
+}
+
+/* Attach the pixmap matching the screen's image size to its image window */
+void scroll_screen_set_image(struct scroll_ctx *ctx, struct scroll_screen *screen) {
+	struct scroll_pixmap *old = screen->pixmap;
+
+	scroll_image_size(ctx, screen->width, screen->height, &screen->image_width, &screen->image_height);
+	screen->pixmap = scroll_get_pixmap(ctx, screen->image_width, screen->image_height);
+
+	if (old)
+		scroll_release_pixmap(ctx, old);
+
+	XSetWindowBackgroundPixmap(ctx->x11.display, screen->image_window, screen->pixmap->pixmap);
+	XClearWindow(ctx->x11.display, screen->image_window);
+}
+
 struct scroll_screen *new_scroll_screen(struct scroll_ctx *ctx, int x, int y, int width, int height) {
 	_debug("Creating screen with size (%d; %d) at (%d; %d)", width, height, x, y);
+	PROBE4(screen_create, x, y, width, height);
 	struct scroll_screen *res = malloc(sizeof(struct scroll_screen));
 
 	res->x = x;
 	res->y = y;
 	res->width = width;
 	res->height = height;
+	res->pixmap = NULL;
 
 	/* Create desktop window */
 	res->window = XCreateSimpleWindow(ctx->x11.display,
@@ -169,44 +498,23 @@ struct scroll_screen *new_scroll_screen(struct scroll_ctx *ctx, int x, int y, in
 	XMapWindow(ctx->x11.display, res->window);
 	XLowerWindow(ctx->x11.display, res->window);
 
-	/* Scale image correctly */
-	imlib_context_set_image(ctx->image);
-	int buf;
-	double scale;
-
-	switch (ctx->opts.scaling_mode) {
-	case SCALE_FIT_VERT:
-		buf = res->height * ctx->opts.scale;
-		scale = (double)buf / imlib_image_get_height();
-		res->image_width = imlib_image_get_width() * scale;
-		res->image_height = buf;
-		break;
-	case SCALE_FIT_HORIZ:
-		buf = res->width * ctx->opts.scale;
-		scale = (double)buf / imlib_image_get_width();
-		res->image_width = buf;
-		res->image_height = imlib_image_get_height() * scale;
-		break;
-	case SCALE_STRETCH:
-	default:
-		res->image_width = res->width * ctx->opts.scale;
-		res->image_height = res->height * ctx->opts.scale;
-		break;
-	}
-
-	/* Draw image to pixmap */
-	Pixmap pixmap = XCreatePixmap(ctx->x11.display, ctx->x11.root, res->image_width, res->image_height, ctx->x11.depth);
-	_check_or_die(pixmap, "Failed to create pixmap");
-	image_to_drawable(pixmap, ctx->image, 0, 0, res->image_width, res->image_height, 1, 1, 1);
+	/* Create the "image window" which is moved around to scroll the image, in the visual of the pixmaps */
+	XSetWindowAttributes attrs;
+	attrs.colormap = ctx->x11.colormap;
+	attrs.border_pixel = 0;
 
-	/* Create the "image window" which is moved around to scroll the image */
-	res->image_window = XCreateSimpleWindow(ctx->x11.display,
+	scroll_image_size(ctx, width, height, &res->image_width, &res->image_height);
+	res->image_window = XCreateWindow(ctx->x11.display,
 		res->window,
 		x, y,
 		res->image_width,
 		res->image_height,
-		0, 0,
-		BlackPixel(ctx->x11.display, 0));
+		0,
+		ctx->x11.depth,
+		InputOutput,
+		ctx->x11.visual,
+		CWColormap | CWBorderPixel,
+		&attrs);
 
 	_check_or_die(res->image_window,
 		"Failed to create image subwindow for window at (%d; %d)",
@@ -214,15 +522,38 @@ struct scroll_screen *new_scroll_screen(struct scroll_ctx *ctx, int x, int y, in
 
 	XMapWindow(ctx->x11.display, res->image_window);
 
-	XSetWindowBackgroundPixmap(ctx->x11.display, res->image_window, pixmap);
-	XClearWindow(ctx->x11.display, res->image_window);
+	scroll_screen_set_image(ctx, res);
 	XFlush(ctx->x11.display);
 
-	XFreePixmap(ctx->x11.display, pixmap);
-
 	return res;
 }
 
+void move_scroll_screen(struct scroll_ctx *ctx, struct scroll_screen *screen, int x, int y) {
+	_debug("Moving screen from (%d; %d) to (%d; %d)", screen->x, screen->y, x, y);
+	screen->x = x;
+	screen->y = y;
+	XMoveWindow(ctx->x11.display, screen->window, x, y);
+}
+
+void resize_scroll_screen(struct scroll_ctx *ctx, struct scroll_screen *screen, int x, int y, int width, int height) {
+	_debug("Resizing screen from (%d; %d) to (%d; %d)", screen->width, screen->height, width, height);
+	screen->x = x;
+	screen->y = y;
+	screen->width = width;
+	screen->height = height;
+	XMoveResizeWindow(ctx->x11.display, screen->window, x, y, width, height);
+
+	scroll_screen_set_image(ctx, screen);
+	XResizeWindow(ctx->x11.display, screen->image_window, screen->image_width, screen->image_height);
+}
+
+void free_scroll_screen(struct scroll_ctx *ctx, struct scroll_screen *screen) {
+	/* Destroys the image window as well */
+	XDestroyWindow(ctx->x11.display, screen->window);
+	scroll_release_pixmap(ctx, screen->pixmap);
+	free(screen);
+}
+
 void scroll_parse_points(struct scroll_ctx *ctx, char *point_string) {
 	int len = strlen(point_string);
 
@@ -290,6 +621,19 @@ void scroll_parse_args(struct scroll_ctx *ctx, int argc, char **argv) {
 			ctx->opts.scaling_mode = atoi(argv[++i]);
 			_check(0 < ctx->opts.scaling_mode && ctx->opts.scaling_mode < SCALE_END, "Scaling mode must be between 0 and %d", SCALE_END-1);
 			break;
+		case 'F': {
+			_check(not_last, "Filter expected");
+			int filter = scroll_filter_parse(argv[++i]);
+			_check(filter >= 0, "Filter must be box, bilinear or lanczos");
+			ctx->opts.filter = filter;
+			break;
+		}
+		case 'R':
+			ctx->opts.reduced = 1;
+			break;
+		case 'G':
+			ctx->opts.linear = 0;
+			break;
 		case 'V':
 			_check(not_last, "Velocity expected");
 			ctx->opts.speed = atof(argv[++i]) / 1000.0;
@@ -304,6 +648,11 @@ void scroll_parse_args(struct scroll_ctx *ctx, int argc, char **argv) {
 			ctx->opts.fps = atoi(argv[++i]);
 			_check(ctx->opts.fps > 0, "FPS must be greater than zero");
 			break;
+		case 'B':
+			_check(not_last, "Battery FPS expected");
+			ctx->opts.battery_fps = atoi(argv[++i]);
+			_check(ctx->opts.battery_fps >= 0, "Battery FPS must not be negative");
+			break;
 		case 'r':
 			_check(not_last, "Bezier resolution expected");
 			ctx->opts.bezier_res = atoi(argv[++i]);
@@ -312,12 +661,59 @@ void scroll_parse_args(struct scroll_ctx *ctx, int argc, char **argv) {
 		case 'b':
 			ctx->opts.bezier = 1;
 			break;
-#ifdef VERSION
+		case 'C':
+			ctx->opts.cache = 0;
+			break;
+		case 'H':
+			ctx->opts.handoff = 1;
+			break;
+		case 'P':
+			ctx->opts.preview = 0;
+			break;
 		case 'v':
-			printf("%s " VERSION "\nCompiled: " DATE "\n", argv[0]);
-			exit(0);
+			scroll_verbose = 1;
 			break;
+		case '-':
+			if (!strcmp(argv[i], "--mem-budget")) {
+				_check(not_last, "Memory budget expected");
+				ctx->opts.mem_budget = scroll_budget_parse(argv[++i]);
+				_check(ctx->opts.mem_budget, "Memory budget must be a size like 256M");
+			} else if (!strcmp(argv[i], "--trace")) {
+				_check(not_last, "Trace file expected");
+				ctx->opts.trace = argv[++i];
+			} else if (!strcmp(argv[i], "--perf")) {
+				ctx->opts.perf = 1;
+			} else if (!strcmp(argv[i], "--status")) {
+				_check(not_last, "Status page name expected");
+				ctx->opts.status = argv[++i];
+			} else if (!strcmp(argv[i], "--journal")) {
+				ctx->opts.journal = 1;
+			} else if (!strcmp(argv[i], "--alloc-check")) {
+				ctx->opts.alloc_check = 1;
+			} else if (!strcmp(argv[i], "--profile")) {
+				_check(not_last, "Profile file expected");
+				ctx->opts.profile = argv[++i];
+			} else if (!strcmp(argv[i], "--profile-hz")) {
+				_check(not_last, "Profiling rate expected");
+				ctx->opts.profile_hz = atoi(argv[++i]);
+				_check(0 < ctx->opts.profile_hz && ctx->opts.profile_hz <= PROF_MAX_HZ,
+					"Profiling rate must be between 1 and %d", PROF_MAX_HZ);
+			} else if (!strcmp(argv[i], "--metrics")) {
+				_check(not_last, "Metrics socket expected");
+				ctx->opts.metrics = argv[++i];
+			} else if (!strcmp(argv[i], "--metrics-port")) {
+				_check(not_last, "Metrics port expected");
+				ctx->opts.metrics_port = atoi(argv[++i]);
+				_check(0 < ctx->opts.metrics_port && ctx->opts.metrics_port < 65536, "Metrics port must be between 1 and 65535");
+			} else {
+				goto error;
+			}
+			break;
+		case 'h':
+#ifdef VERSION
+			printf("%s " VERSION "\nCompiled: " DATE "\n", argv[0]);
 #endif
+			goto error;
 		default:
 			goto error;
 		}
@@ -329,14 +725,9 @@ void scroll_parse_args(struct scroll_ctx *ctx, int argc, char **argv) {
 	return;
 
 error:
-	printf("Usage %s [-h"
-#ifdef VERSION
-		"|-v]"
-#else
-		"]"
-#endif
-		" [-b] [-r BEZIER RESOLUTION] [-f FPS] [-V VELOCITY] "
-		"[-i IMAGE] [-s SCALE] [-p x0,y0;x1,y1;x2,y2;...]\n",
+	printf("Usage %s [-h] [-v] [-C] [-H] [-P] [-F FILTER] [-G] [-R] [--mem-budget SIZE] [--trace FILE] [--metrics SOCKET] [--metrics-port PORT] [--status NAME] [--perf] [--profile FILE] [--profile-hz HZ] [--alloc-check] [--journal] [-b] [-r BEZIER RESOLUTION] [-f FPS] [-B BATTERY FPS] [-V VELOCITY] "
+		"[-i IMAGE] [-s SCALE] [-p x0,y0;x1,y1;x2,y2;...]\n"
+		"  --mem-budget SIZE  limit image memory, JPEGs are decoded at a lower resolution to fit, PNGs only at full size\n",
 		argv[0]);
 	exit(1);
 }
@@ -374,13 +765,114 @@ void scroll_bezierify(struct scroll_ctx *ctx) {
 
 			ctx->anim.points[p].x = ctx->opts.points[i].x + (1 - 2 * t + t__2) * x_0_1 + t__2 * x_2_1;
 			ctx->anim.points[p++].y = ctx->opts.points[i].y + (1 - 2 * t + t__2) * y_0_1 + t__2 * y_2_1;
-			_debug("Bezier: %d: (%f; %f)", j, ctx->anim.points[p - 1].x, ctx->anim.points[p - 1].y);
+			_debug_all("Bezier: %d: (%f; %f)", j, ctx->anim.points[p - 1].x, ctx->anim.points[p - 1].y);
 		}
 	}
 	memcpy(ctx->anim.points, ctx->opts.points, sizeof(struct scroll_vec));
 	memcpy(ctx->anim.points + ctx->anim.num_points - 1, ctx->opts.points + ctx->opts.num_points - 1, sizeof(struct scroll_vec));
 }
 
+/* Keep the pixmaps and image windows in a 16 bit visual, halving the pixmap memory on the server */
+void scroll_init_reduced(struct scroll_ctx *ctx) {
+	XVisualInfo info;
+
+	if (ctx->x11.depth <= 16) {
+		_warn("Display depth is %d already, ignoring -R", ctx->x11.depth);
+		return;
+	}
+	if (!XMatchVisualInfo(ctx->x11.display, DefaultScreen(ctx->x11.display), 16, TrueColor, &info)) {
+		_warn("No 16 bit TrueColor visual, ignoring -R");
+		return;
+	}
+
+	ctx->x11.full_bpp = scroll_depth_bpp(ctx->x11.display, ctx->x11.depth);
+	ctx->x11.visual = info.visual;
+	ctx->x11.depth = 16;
+	/* Goes away with the connection, unless the image windows are handed off */
+	ctx->x11.colormap = XCreateColormap(ctx->x11.display, ctx->x11.root, info.visual, AllocNone);
+
+	/* GCs only work on drawables of their depth */
+	Pixmap pixmap = XCreatePixmap(ctx->x11.display, ctx->x11.root, 1, 1, 16);
+	XFreeGC(ctx->x11.display, ctx->x11.gc);
+	ctx->x11.gc = XCreateGC(ctx->x11.display, pixmap, 0, NULL);
+	XFreePixmap(ctx->x11.display, pixmap);
+}
+
+/* Current and peak resident memory in kB from /proc, returns 0 if they are unavailable */
+int scroll_read_rss(long *rss, long *peak) {
+	FILE *f = fopen("/proc/self/status", "r");
+	char line[256];
+	int found = 0;
+
+	if (!f)
+		return 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "VmRSS: %ld", rss) == 1 || sscanf(line, "VmHWM: %ld", peak) == 1)
+			++found;
+	}
+
+	fclose(f);
+	return found == 2;
+}
+
+/* Logs the pixmap memory of every screen and in total, as tracked by us and as seen by the server,
+ * and the memory held by the process */
+void scroll_report_memory(struct scroll_ctx *ctx) {
+	const double mib = 1024.0 * 1024.0;
+	size_t tracked = 0;
+
+	for (int i = 0; i < ctx->num_screens; i++) {
+		struct scroll_screen *screen = ctx->screens[i];
+		struct scroll_pixmap *pixmap = screen->pixmap;
+		_log("Screen %d at (%d; %d): %dx%d pixmap, %.1f MiB, shared by %d screens",
+			i, screen->x, screen->y, pixmap->width, pixmap->height,
+			scroll_pixmap_bytes(ctx, pixmap) / mib, pixmap->refs);
+	}
+
+	int num_pixmaps = 0;
+	for (struct scroll_pixmap *p = ctx->pixmaps; p; p = p->next, ++num_pixmaps)
+		tracked += scroll_pixmap_bytes(ctx, p);
+
+	/* Handed off pixmaps are owned by the previous client, so the server counts them there */
+	long server = -1;
+#ifdef XRES
+	unsigned long bytes;
+	/* Any of our resources identifies the client */
+	if (ctx->x11.has_xres &&
+		XResQueryClientPixmapBytes(ctx->x11.display, XGContextFromGC(ctx->x11.gc), &bytes))
+		server = bytes;
+#endif
+
+	long rss = -1, peak = -1;
+	scroll_read_rss(&rss, &peak);
+
+	size_t image = ctx->image.pixels ? (size_t) ctx->image.width * ctx->image.height * 4 : 0;
+	if (server >= 0) {
+		_log("Server: %d pixmaps, %.1f MiB tracked, %.1f MiB reported by XRes",
+			num_pixmaps, tracked / mib, server / mib);
+	} else {
+		_log("Server: %d pixmaps, %.1f MiB tracked", num_pixmaps, tracked / mib);
+	}
+	_log("Client: %.1f MiB decoded image, RSS %ld kB, peak %ld kB", image / mib, rss, peak);
+
+	if (ctx->budget.limit) {
+		_log("Budget: %.1f of %.1f MiB used, peak %.1f MiB",
+			scroll_budget_used(&ctx->budget) / mib, ctx->budget.limit / mib, ctx->budget.peak / mib);
+		for (int i = 0; i < BUDGET_END; i++)
+			_log("Budget: %.1f MiB %s", ctx->budget.used[i] / mib, scroll_budget_name(i));
+	}
+}
+
+/* Logs how much server memory the 16 bit pixmaps save */
+void scroll_report_reduced(struct scroll_ctx *ctx) {
+	size_t saved = 0;
+	for (struct scroll_pixmap *p = ctx->pixmaps; p; p = p->next)
+		saved += (size_t) p->width * p->height * (ctx->x11.full_bpp - 16) / 8;
+
+	_log("16 bit pixmaps save %.1f MiB of server memory", saved / (1024.0 * 1024.0));
+}
+
 void scroll_init_x11(struct scroll_ctx *ctx) {
 	ctx->x11.display = XOpenDisplay(NULL);
 	_check_or_die(ctx->x11.display, "Can't open display");
@@ -390,56 +882,903 @@ void scroll_init_x11(struct scroll_ctx *ctx) {
 	ctx->x11.depth = DefaultDepth(ctx->x11.display, DefaultScreen(ctx->x11.display));
 	ctx->x11.colormap = DefaultColormap(ctx->x11.display, DefaultScreen(ctx->x11.display));
 	ctx->x11.gc = XCreateGC(ctx->x11.display, ctx->x11.root, 0, NULL);
+	ctx->x11.full_bpp = 0;
+	if (ctx->opts.reduced)
+		scroll_init_reduced(ctx);
+	ctx->x11.has_format = scroll_format_init(&ctx->x11.format, ctx->x11.display,
+		ctx->x11.visual, ctx->x11.depth);
+	if (!ctx->x11.has_format)
+		_warn("Unsupported visual, falling back to Imlib rendering");
+	ctx->x11.bpp = scroll_depth_bpp(ctx->x11.display, ctx->x11.depth);
+	ctx->x11.width = DisplayWidth(ctx->x11.display, DefaultScreen(ctx->x11.display));
+	ctx->x11.height = DisplayHeight(ctx->x11.display, DefaultScreen(ctx->x11.display));
+
+	/* Get notified when the root window is resized */
+	XSelectInput(ctx->x11.display, ctx->x11.root, StructureNotifyMask);
+
+	ctx->x11.randr_event_base = -1;
+	ctx->x11.randr_monitors = 0;
+	ctx->x11.screens_changed = 0;
+	ctx->x11.screen_updates = 0;
+#ifdef XRANDR
+	int error_base, major, minor;
+	if (XRRQueryExtension(ctx->x11.display, &ctx->x11.randr_event_base, &error_base) &&
+		XRRQueryVersion(ctx->x11.display, &major, &minor)) {
+		/* Monitors were added in RandR 1.5 */
+		ctx->x11.randr_monitors = major > 1 || (major == 1 && minor >= 5);
+
+		XRRSelectInput(ctx->x11.display, ctx->x11.root,
+			RRScreenChangeNotifyMask | RROutputChangeNotifyMask);
+	} else {
+		ctx->x11.randr_event_base = -1;
+	}
+#endif
+
+	ctx->x11.has_xres = 0;
+#ifdef XRES
+	int xres_event_base, xres_error_base;
+	ctx->x11.has_xres = XResQueryExtension(ctx->x11.display, &xres_event_base, &xres_error_base);
+#endif
 }
 
+/* Starts decoding the image, the X connection isn't needed until it is rendered */
 void scroll_init_imlib(struct scroll_ctx *ctx) {
-	imlib_context_set_display(ctx->x11.display);
-	imlib_context_set_visual(ctx->x11.visual);
-	imlib_context_set_colormap(ctx->x11.colormap);
 	imlib_context_set_color_modifier(NULL);
 	imlib_context_set_progress_function(NULL);
 	imlib_context_set_operation(IMLIB_OP_COPY);
 
 	imlib_set_cache_size(4 * 1024 * 1024);
 
-	ctx->image = imlib_load_image(ctx->opts.image);
-	_check_or_die(ctx->image, "Can't load image");
+	ctx->loader.budgeted = ctx->budget.limit != 0;
+	scroll_image_load_async(&ctx->loader, ctx->opts.image, &ctx->image);
 }
 
-void scroll_init_screens(struct scroll_ctx *ctx) {
-	/* Add a window for every screen */
+/* Whether the decoded image has enough resolution for the given target, or as much as the budget allows */
+int scroll_image_covers(struct scroll_ctx *ctx, int width, int height) {
+	return (ctx->image.width >= width && ctx->image.height >= height) ||
+		ctx->image.width == ctx->image.full_width || ctx->loader.limited;
+}
+
+static size_t scroll_image_bytes(struct scroll_ctx *ctx) {
+	return ctx->image.pixels ? (size_t) ctx->image.width * ctx->image.height * sizeof(uint32_t) : 0;
+}
+
+/* Waits for an image with at least the given size, the decoder may scale down to it,
+ * or further down to max_bytes unless it is 0 */
+void scroll_wait_image(struct scroll_ctx *ctx, int width, int height, size_t max_bytes) {
+	if (!ctx->loader.running && ctx->loader.ok && scroll_image_covers(ctx, width, height))
+		return;
+
+	int start = millis();
+	scroll_image_set_target(&ctx->loader, width, height, max_bytes);
+
+	int ok = scroll_image_wait(&ctx->loader);
+	if ((!ok && ctx->loader.cancelled) || (ok && !scroll_image_covers(ctx, width, height))) {
+		/* The cache covered every screen so far, or a new screen needs more resolution */
+		scroll_image_free(&ctx->image);
+		scroll_image_load_async(&ctx->loader, ctx->opts.image, &ctx->image);
+		scroll_image_set_target(&ctx->loader, width, height, max_bytes);
+		scroll_image_wait(&ctx->loader);
+	}
+
+	_check_or_die(ctx->loader.ok, "Can't load image");
+	scroll_budget_set(&ctx->budget, BUDGET_IMAGE, scroll_image_bytes(ctx));
+	if (ctx->loader.limited)
+		_warn("Decoded the image at %dx%d to stay within the memory budget", ctx->image.width, ctx->image.height);
+	_verbose("Decoded %dx%d image at 1/%d scale in %d ms, waited %d ms",
+		ctx->image.full_width, ctx->image.full_height, ctx->loader.scale_denom,
+		ctx->loader.millis, millis() - start);
+
+	ctx->source_width = ctx->image.full_width;
+	ctx->source_height = ctx->image.full_height;
+
+	imlib_context_set_display(ctx->x11.display);
+	imlib_context_set_visual(ctx->x11.visual);
+	imlib_context_set_colormap(ctx->x11.colormap);
+}
+
+/* Frees the decoded image once every screen has its pixmap, new image sizes decode it again */
+void scroll_release_image(struct scroll_ctx *ctx) {
+	scroll_image_cancel(&ctx->loader);
+	scroll_image_wait(&ctx->loader);
+	if (!ctx->image.pixels)
+		return;
+
+	scroll_image_free(&ctx->image);
+	scroll_budget_set(&ctx->budget, BUDGET_IMAGE, 0);
+
+	/* Looks like a cancelled decode to scroll_wait_image, which reloads it */
+	ctx->loader.ok = 0;
+	ctx->loader.cancelled = 1;
+
+	/* Imlib's cache would only help loading the same file again, which happens rarely */
+	imlib_set_cache_size(0);
+#ifdef __GLIBC__
+	/* Return the freed image to the system, glibc keeps large freed blocks in the heap otherwise */
+	malloc_trim(0);
+#endif
+
+	long rss, peak;
+	if (scroll_read_rss(&rss, &peak))
+		_verbose("Released the decoded image, RSS %ld kB, peak %ld kB", rss, peak);
+}
+
+/* Returns the geometry of every monitor, falling back to the whole screen */
+int scroll_query_monitors(struct scroll_ctx *ctx, struct scroll_rect **rects) {
+#ifdef XRANDR
+	if (ctx->x11.randr_monitors) {
+		int num;
+		XRRMonitorInfo *monitors = XRRGetMonitors(ctx->x11.display, ctx->x11.root, True, &num);
+
+		if (monitors && num > 0) {
+			*rects = malloc(sizeof(struct scroll_rect) * num);
+			for (int i = 0; i < num; i++) {
+				(*rects)[i] = (struct scroll_rect) {
+					monitors[i].x, monitors[i].y,
+					monitors[i].width, monitors[i].height
+				};
+			}
+			XRRFreeMonitors(monitors);
+			return num;
+		}
+
+		if (monitors)
+			XRRFreeMonitors(monitors);
+	}
+#endif
 #ifdef XINERAMA
 	if (XineramaIsActive(ctx->x11.display)) {
-		XineramaScreenInfo *xinerama_screens = XineramaQueryScreens(ctx->x11.display, &ctx->num_screens);
+		int num;
+		XineramaScreenInfo *xinerama_screens = XineramaQueryScreens(ctx->x11.display, &num);
+
+		if (xinerama_screens && num > 0) {
+			*rects = malloc(sizeof(struct scroll_rect) * num);
+			for (int i = 0; i < num; i++) {
+				(*rects)[i] = (struct scroll_rect) {
+					xinerama_screens[i].x_org, xinerama_screens[i].y_org,
+					xinerama_screens[i].width, xinerama_screens[i].height
+				};
+			}
+			XFree(xinerama_screens);
+			return num;
+		}
+
+		if (xinerama_screens)
+			XFree(xinerama_screens);
+	}
+#endif
+
+	*rects = malloc(sizeof(struct scroll_rect));
+	(*rects)[0] = (struct scroll_rect) { 0, 0, ctx->x11.width, ctx->x11.height };
+	return 1;
+}
+
+void scroll_init_cache(struct scroll_ctx *ctx) {
+	int identified = ctx->x11.has_format &&
+		scroll_cache_key_init(&ctx->cache_key, ctx->opts.image, ctx->opts.scale,
+			ctx->opts.scaling_mode, ctx->opts.filter, ctx->opts.linear, ctx->x11.depth, &ctx->x11.format);
+
+	ctx->has_cache = ctx->opts.cache && identified;
+
+	/* Identifies the scaled images independent of the screen size */
+	if (identified)
+		ctx->image_hash = hash_bytes(&ctx->cache_key, sizeof(ctx->cache_key), HASH_INIT);
+}
+
+/* Uploads the cached image for a screen, returns 0 on a cache miss */
+int scroll_prepare_cached(struct scroll_ctx *ctx, struct scroll_rect *rect) {
+	struct scroll_cache_entry entry;
+	int start = millis();
+
+	ctx->cache_key.screen_width = rect->width;
+	ctx->cache_key.screen_height = rect->height;
+	if (!scroll_cache_load(&ctx->cache_key, &entry))
+		return 0;
+
+	ctx->source_width = entry.source_width;
+	ctx->source_height = entry.source_height;
+	scroll_budget_add(&ctx->budget, BUDGET_CACHE, entry.map_size);
+
+	if (!scroll_find_pixmap(ctx, entry.scaled.width, entry.scaled.height)) {
+		struct scroll_pixmap *pixmap = scroll_new_pixmap(ctx, entry.scaled.width, entry.scaled.height);
+		scroll_scaled_put(ctx->x11.display, ctx->x11.visual, ctx->x11.depth,
+			pixmap->pixmap, ctx->x11.gc, &entry.scaled);
+		XFlush(ctx->x11.display);
+
+		_verbose("Uploaded cached %dx%d image in %d ms",
+			entry.scaled.width, entry.scaled.height, millis() - start);
+	}
+
+	scroll_cache_release(&entry);
+	scroll_budget_sub(&ctx->budget, BUDGET_CACHE, entry.map_size);
+	return 1;
+}
+
+/* Grows the smallest decoded size which still covers the screen's image size.
+ * The fit modes only depend on one axis, the other follows from the aspect ratio. */
+void scroll_decode_target(struct scroll_ctx *ctx, struct scroll_rect *rect, int *width, int *height) {
+	int w = rect->width * ctx->opts.scale;
+	int h = rect->height * ctx->opts.scale;
+
+	if (ctx->opts.scaling_mode != SCALE_FIT_VERT && w > *width)
+		*width = w;
+	if (ctx->opts.scaling_mode != SCALE_FIT_HORIZ && h > *height)
+		*height = h;
+}
 
-		ctx->screens = malloc(sizeof(struct scroll_screen *) * ctx->num_screens);
+/* Runs on the scaling thread while the image is uploaded, stores it once for every screen size it was scaled for */
+static void scroll_on_scaled(struct scroll_scale_job *job, void *data) {
+	struct scroll_prepare *prep = data;
+	struct scroll_cache_key key = prep->ctx->cache_key;
 
-		for (int i = 0; i < ctx->num_screens; i++) {
-		  ctx->screens[i] = new_scroll_screen(ctx, xinerama_screens[i].x_org, xinerama_screens[i].y_org,
-				xinerama_screens[i].width, xinerama_screens[i].height);
+	/* Decoded below full resolution for the budget, the key can't tell and later starts would get it too */
+	if (prep->ctx->loader.limited)
+		return;
+
+	for (int i = 0; i < prep->num_rects; i++) {
+		int width, height;
+		scroll_image_size(prep->ctx, prep->rects[i].width, prep->rects[i].height, &width, &height);
+
+		if (!prep->pending[i] || width != job->out.width || height != job->out.height)
+			continue;
+
+		/* Screens of the same size share the entry */
+		int stored = 0;
+		for (int j = 0; j < i && !stored; j++) {
+			stored = prep->pending[j] && prep->rects[j].width == prep->rects[i].width &&
+				prep->rects[j].height == prep->rects[i].height;
+		}
+
+		if (!stored) {
+			key.screen_width = prep->rects[i].width;
+			key.screen_height = prep->rects[i].height;
+			scroll_cache_store(&key, prep->ctx->source_width, prep->ctx->source_height, &job->out);
 		}
 	}
-#else
-	Screen *screen = ScreenOfDisplay(ctx->x11.display, DefaultScreen(ctx->x11.display));
-	ctx->num_screens = 1;
-	ctx->screens = malloc(sizeof(struct scroll_screen *));
-	ctx->screens[0] = new_scroll_screen(ctx, 0, 0, screen->width, screen->height);
-#endif
+}
+
+/* Collects the distinct image sizes of the pending screens which have no pixmap yet */
+int scroll_pending_sizes(struct scroll_ctx *ctx, struct scroll_prepare *prep, int **sizes) {
+	int num_sizes = 0;
+	*sizes = malloc(sizeof(int) * 2 * prep->num_rects);
+
+	for (int i = 0; i < prep->num_rects; i++) {
+		int width, height, known = 0;
+		if (!prep->pending[i])
+			continue;
+
+		scroll_image_size(ctx, prep->rects[i].width, prep->rects[i].height, &width, &height);
+
+		for (int j = 0; j < num_sizes && !known; j++)
+			known = (*sizes)[j * 2] == width && (*sizes)[j * 2 + 1] == height;
+
+		if (!known && !scroll_find_pixmap(ctx, width, height)) {
+			(*sizes)[num_sizes * 2] = width;
+			(*sizes)[num_sizes * 2 + 1] = height;
+			++num_sizes;
+		}
+	}
+
+	return num_sizes;
+}
+
+/* Bytes of the scaled images for the given sizes */
+size_t scroll_scaled_size(struct scroll_ctx *ctx, const int *sizes, int num_sizes) {
+	size_t res = 0;
+	for (int i = 0; i < num_sizes; i++)
+		res += (size_t) ((sizes[i * 2] * ctx->x11.format.bytes_per_pixel + 3) & ~3) * sizes[i * 2 + 1];
+	return res;
+}
+
+/* Estimates the pixmap bytes the pending screens add and the largest of them. Before
+ * the source size is known the fit modes are estimated like stretching. */
+size_t scroll_pending_bytes(struct scroll_ctx *ctx, struct scroll_prepare *prep, size_t *largest) {
+	size_t res = 0;
+	*largest = 0;
+
+	for (int i = 0; i < prep->num_rects; i++) {
+		int width = prep->rects[i].width * ctx->opts.scale, height = prep->rects[i].height * ctx->opts.scale;
+		if (!prep->pending[i])
+			continue;
+
+		if (ctx->source_width)
+			scroll_image_size(ctx, prep->rects[i].width, prep->rects[i].height, &width, &height);
+
+		size_t bytes = (size_t) width * height * ctx->x11.bpp / 8;
+		res += bytes;
+		*largest = MAX(*largest, bytes);
+	}
+
+	return res;
+}
+
+/* Waits for the decoder and scales every size, the results are uploaded by scroll_refine_finish */
+static void *scroll_refine_thread(void *data) {
+	struct scroll_ctx *ctx = data;
+	scroll_prof_thread();
+	struct scroll_refine *refine = &ctx->refine;
+
+	refine->ok = scroll_image_wait(&ctx->loader);
+	if (refine->ok) {
+		/* The images are uploaded once all are scaled, so they can't wait for each other */
+		scroll_scale_batch_start(&refine->batch, &ctx->image, &ctx->x11.format, ctx->opts.filter, ctx->opts.linear, NULL,
+			refine->sizes, refine->num_sizes, ctx->has_cache ? scroll_on_scaled : NULL, &refine->prep);
+		while (scroll_scale_batch_next(&refine->batch))
+			;
+	}
+
+	scroll_event_notify(refine->event_fd);
+	return NULL;
+}
+
+/* Swap the full quality images in for the previews, blocking until they are scaled */
+void scroll_refine_finish(struct scroll_ctx *ctx) {
+	struct scroll_refine *refine = &ctx->refine;
+	if (!refine->running)
+		return;
+
+	if (refine->threaded)
+		pthread_join(refine->thread, NULL);
+	refine->running = 0;
+	scroll_event_read(refine->event_fd);
+
+	_check_or_die(refine->ok, "Can't load image");
+	_verbose("Decoded %dx%d image at 1/%d scale in %d ms",
+		ctx->image.full_width, ctx->image.full_height, ctx->loader.scale_denom, ctx->loader.millis);
+	scroll_budget_set(&ctx->budget, BUDGET_IMAGE, scroll_image_bytes(ctx));
+
+	ctx->timing.scale_millis = 0;
+	for (int i = 0; i < refine->batch.num_jobs; i++) {
+		struct scroll_scale_job *job = &refine->batch.jobs[i];
+		struct scroll_pixmap *pixmap = scroll_find_pixmap(ctx, job->out.width, job->out.height);
+		ctx->timing.scale_millis = MAX(ctx->timing.scale_millis, job->millis);
+
+		/* The screens may have been rebuilt meanwhile, keep the image for the new ones */
+		if (!pixmap) {
+			pixmap = scroll_new_pixmap(ctx, job->out.width, job->out.height);
+			scroll_scaled_put(ctx->x11.display, ctx->x11.visual, ctx->x11.depth,
+				pixmap->pixmap, ctx->x11.gc, &job->out);
+			continue;
+		}
+
+		if (!pixmap->preview)
+			continue;
+
+		/* Upload to a new pixmap so no screen ever shows a partially updated image */
+		Pixmap old = pixmap->pixmap;
+		pixmap->pixmap = XCreatePixmap(ctx->x11.display, ctx->x11.root, pixmap->width, pixmap->height,
+			ctx->x11.depth);
+		pixmap->preview = 0;
+		scroll_scaled_put(ctx->x11.display, ctx->x11.visual, ctx->x11.depth,
+			pixmap->pixmap, ctx->x11.gc, &job->out);
+
+		for (int j = 0; j < ctx->num_screens; j++) {
+			if (ctx->screens[j]->pixmap == pixmap) {
+				XSetWindowBackgroundPixmap(ctx->x11.display, ctx->screens[j]->image_window, pixmap->pixmap);
+				XClearWindow(ctx->x11.display, ctx->screens[j]->image_window);
+			}
+		}
+		XFreePixmap(ctx->x11.display, old);
+	}
+
+	XFlush(ctx->x11.display);
+	_verbose("Replaced previews after %d ms", millis() - refine->start);
+
+	scroll_scale_batch_free(&refine->batch);
+	scroll_budget_sub(&ctx->budget, BUDGET_SCALED, scroll_scaled_size(ctx, refine->sizes, refine->num_sizes));
+	free(refine->sizes);
+	free(refine->prep.rects);
+	free(refine->prep.pending);
+}
+
+/* Shows a quickly decoded low resolution version on every pending screen and scales the full
+ * image in the background. Takes over prep, returns 0 if the image has no preview. */
+int scroll_prepare_preview(struct scroll_ctx *ctx, struct scroll_prepare *prep) {
+	struct scroll_refine *refine = &ctx->refine;
+	struct scroll_image preview;
+	int start = millis();
+
+	if (!scroll_image_preview(ctx->opts.image, &preview))
+		return 0;
+
+	ctx->source_width = preview.full_width;
+	ctx->source_height = preview.full_height;
+
+	refine->start = start;
+	refine->prep = *prep;
+	refine->prep.rects = malloc(sizeof(struct scroll_rect) * prep->num_rects);
+	memcpy(refine->prep.rects, prep->rects, sizeof(struct scroll_rect) * prep->num_rects);
+	refine->num_sizes = scroll_pending_sizes(ctx, &refine->prep, &refine->sizes);
+	scroll_budget_add(&ctx->budget, BUDGET_SCALED, scroll_scaled_size(ctx, refine->sizes, refine->num_sizes));
+
+	for (int i = 0; i < refine->num_sizes; i++) {
+		struct scroll_scaled scaled = { refine->sizes[i * 2], refine->sizes[i * 2 + 1], 0, NULL };
+		scroll_scale(&preview, &ctx->x11.format, FILTER_BILINEAR, 0, &scaled);
+
+		struct scroll_pixmap *pixmap = scroll_new_pixmap(ctx, scaled.width, scaled.height);
+		pixmap->preview = 1;
+		scroll_scaled_put(ctx->x11.display, ctx->x11.visual, ctx->x11.depth,
+			pixmap->pixmap, ctx->x11.gc, &scaled);
+		scroll_scaled_free(&scaled);
+	}
+
+	XFlush(ctx->x11.display);
+	_verbose("Showing %dx%d preview after %d ms", preview.width, preview.height, millis() - start);
+	scroll_image_free(&preview);
+
+	refine->running = 1;
+	refine->threaded = !pthread_create(&refine->thread, NULL, scroll_refine_thread, ctx);
+	if (!refine->threaded) {
+		_warn("Failed to start scaling thread, scaling synchronously");
+		scroll_refine_thread(ctx);
+	}
+
+	return 1;
+}
+
+/* Scale the image for every missing image size in parallel and upload each as it finishes */
+void scroll_prepare_pixmaps(struct scroll_ctx *ctx, struct scroll_rect *rects, int num_rects) {
+	struct scroll_prepare prep = { ctx, rects, calloc(num_rects, sizeof(int)), num_rects };
+	int num_pending = 0;
+
+	/* Previews are replaced before anything else may need the image */
+	scroll_refine_finish(ctx);
+
+	/* Try the cache before waiting for the decoder */
+	for (int i = 0; i < num_rects; i++) {
+		int width, height;
+
+		if (ctx->source_width) {
+			scroll_image_size(ctx, rects[i].width, rects[i].height, &width, &height);
+			if (scroll_find_pixmap(ctx, width, height))
+				continue;
+		}
+
+		if (ctx->has_cache && scroll_prepare_cached(ctx, &rects[i]))
+			continue;
+
+		prep.pending[i] = 1;
+		++num_pending;
+	}
+
+	if (!num_pending) {
+		scroll_image_cancel(&ctx->loader);
+		free(prep.pending);
+		return;
+	}
+
+	int target_width = 0, target_height = 0;
+	for (int i = 0; i < num_rects; i++) {
+		if (prep.pending[i])
+			scroll_decode_target(ctx, &rects[i], &target_width, &target_height);
+	}
+
+	/* The decoded image gets what the budget leaves after the new pixmaps and one scaled image,
+	 * a preview holds every scaled image until all are done */
+	size_t max_bytes = 0, preview_bytes = 0;
+	int preview = ctx->opts.preview;
+	if (ctx->budget.limit) {
+		size_t largest, pixmaps = scroll_pending_bytes(ctx, &prep, &largest);
+		size_t available = scroll_budget_available(&ctx->budget);
+
+		if (pixmaps + largest < available) {
+			max_bytes = available - pixmaps - largest;
+		} else {
+			_warn("The new pixmaps need %.1f MiB, %.1f MiB of the memory budget are left, try -R or a smaller scale",
+				pixmaps / (1024.0 * 1024.0), available / (1024.0 * 1024.0));
+			max_bytes = 1;
+		}
+
+		if (preview && 2 * pixmaps < available) {
+			preview_bytes = available - 2 * pixmaps;
+		} else if (preview) {
+			_verbose("Skipping the preview, the scaled images wouldn't fit into the memory budget");
+			preview = 0;
+		}
+	}
+
+	/* Only worth it while the first decode is still running */
+	if (preview && ctx->x11.has_format && ctx->loader.running &&
+		!scroll_loader_cancelled(&ctx->loader)) {
+		scroll_image_set_target(&ctx->loader, target_width, target_height, preview_bytes);
+		if (scroll_prepare_preview(ctx, &prep))
+			return;
+	}
+
+	scroll_wait_image(ctx, target_width, target_height, max_bytes);
+	if (!ctx->x11.has_format) {
+		free(prep.pending);
+		return;
+	}
+
+	int *sizes;
+	int num_sizes = scroll_pending_sizes(ctx, &prep, &sizes);
+
+	if (num_sizes) {
+		struct scroll_scale_batch batch;
+		struct scroll_scale_job *job;
+		scroll_scale_batch_start(&batch, &ctx->image, &ctx->x11.format, ctx->opts.filter, ctx->opts.linear, &ctx->budget,
+			sizes, num_sizes, ctx->has_cache ? scroll_on_scaled : NULL, &prep);
+
+		ctx->timing.scale_millis = 0;
+		while ((job = scroll_scale_batch_next(&batch))) {
+			int start = millis();
+			ctx->timing.scale_millis = MAX(ctx->timing.scale_millis, job->millis);
+			struct scroll_pixmap *pixmap = scroll_new_pixmap(ctx, job->out.width, job->out.height);
+			scroll_scaled_put(ctx->x11.display, ctx->x11.visual, ctx->x11.depth,
+				pixmap->pixmap, ctx->x11.gc, &job->out);
+			XFlush(ctx->x11.display);
+			scroll_scale_job_release(job);
+
+			_verbose("Scaled to %dx%d in %d ms, uploaded in %d ms",
+				job->out.width, job->out.height, job->millis, millis() - start);
+		}
+
+		scroll_scale_batch_free(&batch);
+	}
+
+	free(sizes);
+	free(prep.pending);
+}
+
+/* Bring ctx->screens in line with the current monitors, touching only screens that changed */
+void scroll_update_screens(struct scroll_ctx *ctx) {
+	struct scroll_rect *rects;
+	int num_rects = scroll_query_monitors(ctx, &rects);
+	int64_t trace = scroll_trace_now();
+	scroll_prepare_pixmaps(ctx, rects, num_rects);
+	scroll_trace_span("prepare_pixmaps", trace, scroll_trace_now(), num_rects);
+
+	struct scroll_screen **screens = calloc(num_rects, sizeof(struct scroll_screen *));
+	struct scroll_screen **old = ctx->screens;
+	int kept = 0, moved = 0, resized = 0, created = 0, destroyed = 0;
+
+	/* Keep screens whose geometry didn't change */
+	for (int i = 0; i < num_rects; i++) {
+		for (int j = 0; j < ctx->num_screens; j++) {
+			if (old[j] && old[j]->x == rects[i].x && old[j]->y == rects[i].y &&
+				old[j]->width == rects[i].width && old[j]->height == rects[i].height) {
+				screens[i] = old[j];
+				old[j] = NULL;
+				++kept;
+				break;
+			}
+		}
+	}
+
+	/* Move screens which only changed position */
+	for (int i = 0; i < num_rects; i++) {
+		for (int j = 0; !screens[i] && j < ctx->num_screens; j++) {
+			if (old[j] && old[j]->width == rects[i].width && old[j]->height == rects[i].height) {
+				trace = scroll_trace_now();
+				move_scroll_screen(ctx, old[j], rects[i].x, rects[i].y);
+				scroll_trace_span("move_screen", trace, scroll_trace_now(), i);
+				screens[i] = old[j];
+				old[j] = NULL;
+				++moved;
+			}
+		}
+	}
+
+	/* Reuse the windows of the remaining screens for monitors with a new size */
+	for (int i = 0; i < num_rects; i++) {
+		for (int j = 0; !screens[i] && j < ctx->num_screens; j++) {
+			if (old[j]) {
+				trace = scroll_trace_now();
+				resize_scroll_screen(ctx, old[j], rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+				scroll_trace_span("resize_screen", trace, scroll_trace_now(), i);
+				screens[i] = old[j];
+				old[j] = NULL;
+				++resized;
+			}
+		}
+	}
+
+	/* Add a window for every new screen */
+	for (int i = 0; i < num_rects; i++) {
+		if (!screens[i]) {
+			trace = scroll_trace_now();
+			screens[i] = new_scroll_screen(ctx, rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+			scroll_trace_span("new_screen", trace, scroll_trace_now(), i);
+			++created;
+		}
+	}
+
+	/* Destroy screens of unplugged monitors last, so new screens can share their pixmaps */
+	for (int j = 0; j < ctx->num_screens; j++) {
+		if (old[j]) {
+			free_scroll_screen(ctx, old[j]);
+			++destroyed;
+		}
+	}
+
+	free(old);
+	free(rects);
+	ctx->screens = screens;
+	ctx->num_screens = num_rects;
+	scroll_sweep_pixmaps(ctx);
+
+	XFlush(ctx->x11.display);
+	_log("Screens: %d kept, %d moved, %d resized, %d created, %d destroyed",
+		kept, moved, resized, created, destroyed);
+	++ctx->x11.screen_updates;
+
+	/* With a preview on screen the image is still being scaled */
+	if (!ctx->refine.running)
+		scroll_release_image(ctx);
+
+	if (scroll_verbose)
+		scroll_report_memory(ctx);
+}
+
+void scroll_init_screens(struct scroll_ctx *ctx) {
+	scroll_update_screens(ctx);
+}
+
+void scroll_free_screens(struct scroll_ctx *ctx) {
+	for (int i = 0; i < ctx->num_screens; i++)
+		free_scroll_screen(ctx, ctx->screens[i]);
+
+	free(ctx->screens);
+	ctx->screens = NULL;
+	ctx->num_screens = 0;
+	/* Prepared pixmaps no screen took are still on the list */
+	scroll_sweep_pixmaps(ctx);
+}
+
+void scroll_rebuild_screens(struct scroll_ctx *ctx) {
+	_log("Rebuilding screens");
+	scroll_free_screens(ctx);
+	scroll_init_screens(ctx);
+}
+
+void scroll_init_loop(struct scroll_ctx *ctx) {
+	/* Block the signals before any other thread exists so only the loop sees them */
+	int signals[] = { SIGTERM, SIGINT, SIGHUP, SIGUSR1, SIGUSR2 };
+	ctx->signal_fd = scroll_signal_new(signals, sizeof(signals) / sizeof(*signals));
+
+	scroll_loop_init(&ctx->loop);
+	ctx->timing.frame_timer = scroll_timer_new();
+	ctx->refine.event_fd = scroll_event_new();
+	if (ctx->opts.battery_fps >= 0)
+		ctx->timing.power_timer = scroll_timer_new();
+}
+
+void scroll_start_segment(struct scroll_ctx *ctx, int point) {
+	ctx->anim.cur_point = point;
+	int next_point = (ctx->anim.cur_point + 1) % ctx->anim.num_points;
+
+	ctx->anim.cur_vector.x = ctx->anim.points[next_point].x - ctx->anim.points[ctx->anim.cur_point].x;
+	ctx->anim.cur_vector.y = ctx->anim.points[next_point].y - ctx->anim.points[ctx->anim.cur_point].y;
+
+	ctx->anim.cur_travel_time = ABS(ctx->anim.cur_vector) / ctx->opts.speed;
+	ctx->anim.cur_time = 0;
+
+	_debug("Moving to point %d at (%f,%f) via vector (%f,%f) in %f millis",
+		next_point, ctx->anim.points[next_point].x, ctx->anim.points[next_point].y,
+		ctx->anim.cur_vector.x, ctx->anim.cur_vector.y,
+		ctx->anim.cur_travel_time);
+}
+
+/* Handoff */
+#define HANDOFF_ATOM "_SCROLL_HANDOFF"
+#define HANDOFF_VERSION 1
+#define HANDOFF_HEADER 10
+#define HANDOFF_SCREEN 9
+#define U32(V) ((uint64_t) (V) & 0xffffffff)
+
+uint64_t scroll_path_hash(struct scroll_ctx *ctx) {
+	uint64_t hash = hash_bytes(ctx->anim.points, sizeof(struct scroll_vec) * ctx->anim.num_points, HASH_INIT);
+	return hash_bytes(&ctx->opts.speed, sizeof(ctx->opts.speed), hash);
+}
+
+static int scroll_ignore_error(Display *display, XErrorEvent *ev) {
+	return 0;
+}
+
+/* Publish the windows, pixmaps and timeline position on the root window and keep them alive after exit */
+void scroll_handoff_publish(struct scroll_ctx *ctx) {
+	int len = HANDOFF_HEADER + HANDOFF_SCREEN * ctx->num_screens;
+	long *data = malloc(sizeof(long) * len);
+	uint64_t path_hash = scroll_path_hash(ctx);
+
+	data[0] = HANDOFF_VERSION;
+	data[1] = U32(ctx->image_hash >> 32);
+	data[2] = U32(ctx->image_hash);
+	data[3] = U32(path_hash >> 32);
+	data[4] = U32(path_hash);
+	data[5] = ctx->source_width;
+	data[6] = ctx->source_height;
+	data[7] = ctx->anim.cur_point;
+	data[8] = ctx->anim.cur_time;
+	data[9] = ctx->num_screens;
+
+	for (int i = 0; i < ctx->num_screens; i++) {
+		struct scroll_screen *screen = ctx->screens[i];
+		long *s = data + HANDOFF_HEADER + i * HANDOFF_SCREEN;
+
+		s[0] = screen->x;
+		s[1] = screen->y;
+		s[2] = screen->width;
+		s[3] = screen->height;
+		s[4] = screen->image_width;
+		s[5] = screen->image_height;
+		s[6] = screen->window;
+		s[7] = screen->image_window;
+		s[8] = screen->pixmap->pixmap;
+	}
+
+	Atom atom = XInternAtom(ctx->x11.display, HANDOFF_ATOM, False);
+	XChangeProperty(ctx->x11.display, ctx->x11.root, atom, XA_CARDINAL, 32, PropModeReplace,
+		(unsigned char *) data, len);
+	XSetCloseDownMode(ctx->x11.display, RetainPermanent);
+	free(data);
+
+	_log("Handing off %d screens", ctx->num_screens);
+}
+
+/* Take over the screens of a previous instance rendering the same image, destroy the rest */
+void scroll_handoff_adopt(struct scroll_ctx *ctx) {
+	Atom atom = XInternAtom(ctx->x11.display, HANDOFF_ATOM, False);
+	Atom type;
+	int format;
+	unsigned long len, after;
+	unsigned char *prop = NULL;
+
+	if (XGetWindowProperty(ctx->x11.display, ctx->x11.root, atom, 0, 65536, True, XA_CARDINAL,
+		&type, &format, &len, &after, &prop) != Success || !prop)
+		return;
+
+	long *data = (long *) prop;
+	if (format != 32 || len < HANDOFF_HEADER || data[0] != HANDOFF_VERSION ||
+		len != HANDOFF_HEADER + HANDOFF_SCREEN * U32(data[9])) {
+		_warn("Ignoring invalid handoff");
+		XFree(prop);
+		return;
+	}
+
+	int adopt = ctx->image_hash && ctx->image_hash == (U32(data[1]) << 32 | U32(data[2]));
+	int num = data[9], adopted = 0;
+
+	ctx->handoff = (struct scroll_handoff) {
+		1,
+		U32(data[3]) << 32 | U32(data[4]),
+		data[7],
+		data[8]
+	};
+
+	if (adopt) {
+		ctx->source_width = data[5];
+		ctx->source_height = data[6];
+		ctx->screens = malloc(sizeof(struct scroll_screen *) * num);
+	}
+
+	/* The resources may have vanished with a server reset or a crash */
+	XSync(ctx->x11.display, False);
+	int (*handler)(Display *, XErrorEvent *) = XSetErrorHandler(scroll_ignore_error);
+
+	for (int i = 0; i < num; i++) {
+		long *s = data + HANDOFF_HEADER + i * HANDOFF_SCREEN;
+		XWindowAttributes attrs;
+		Window root;
+		int x, y;
+		unsigned int w, h, border, depth;
+
+		if (!adopt || !XGetWindowAttributes(ctx->x11.display, s[6], &attrs) ||
+			!XGetGeometry(ctx->x11.display, s[8], &root, &x, &y, &w, &h, &border, &depth) ||
+			w != s[4] || h != s[5] || depth != ctx->x11.depth) {
+			XDestroyWindow(ctx->x11.display, s[6]);
+			continue;
+		}
+
+		struct scroll_screen *screen = malloc(sizeof(struct scroll_screen));
+		*screen = (struct scroll_screen) {
+			s[0], s[1],
+			s[2], s[3],
+			s[6],
+			s[7],
+			s[4], s[5],
+			NULL
+		};
+
+		/* Screens of the same image size share a pixmap */
+		for (struct scroll_pixmap *p = ctx->pixmaps; p && !screen->pixmap; p = p->next) {
+			if (p->pixmap == (Pixmap) s[8])
+				screen->pixmap = p;
+		}
+
+		if (!screen->pixmap) {
+			screen->pixmap = malloc(sizeof(struct scroll_pixmap));
+			*screen->pixmap = (struct scroll_pixmap) { s[8], s[4], s[5], 0, ctx->pixmaps, 0 };
+			ctx->pixmaps = screen->pixmap;
+			scroll_budget_add(&ctx->budget, BUDGET_PIXMAPS, scroll_pixmap_bytes(ctx, screen->pixmap));
+		}
+
+		++screen->pixmap->refs;
+		ctx->screens[adopted++] = screen;
+	}
+
+	/* A rejected screen may share its pixmap with an adopted one, only free the pixmaps nobody took */
+	for (int i = 0; i < num; i++) {
+		long *s = data + HANDOFF_HEADER + i * HANDOFF_SCREEN;
+		int used = 0;
+
+		for (struct scroll_pixmap *p = ctx->pixmaps; p && !used; p = p->next)
+			used = p->pixmap == (Pixmap) s[8];
+		/* Screens of the same size list the same pixmap */
+		for (int j = 0; j < i && !used; j++)
+			used = data[HANDOFF_HEADER + j * HANDOFF_SCREEN + 8] == s[8];
+
+		if (!used)
+			XFreePixmap(ctx->x11.display, s[8]);
+	}
+
+	XSync(ctx->x11.display, False);
+	XSetErrorHandler(handler);
+
+	ctx->num_screens = adopted;
+	_log("Adopted %d of %d screens from the previous instance", adopted, num);
+	XFree(prop);
+}
+
+/* Continue where the previous instance stopped if it moved along the same path */
+void scroll_handoff_resume(struct scroll_ctx *ctx) {
+	if (!ctx->handoff.valid || ctx->handoff.path_hash != scroll_path_hash(ctx) ||
+		ctx->handoff.cur_point < 0 || ctx->handoff.cur_point >= ctx->anim.num_points)
+		return;
+
+	scroll_start_segment(ctx, ctx->handoff.cur_point);
+	ctx->anim.cur_time = ctx->handoff.cur_time;
+	_debug("Resuming at point %d after %d millis", ctx->handoff.cur_point, ctx->handoff.cur_time);
 }
 
 void scroll_setup(struct scroll_ctx *ctx) {
-	scroll_init_x11(ctx);
+	int start = millis();
+
+	if (ctx->opts.trace && !scroll_trace_open(ctx->opts.trace))
+		_warn("Can't open trace file %s", ctx->opts.trace);
+	/* Before the decoder thread starts */
+	if (ctx->opts.perf)
+		scroll_perf_init();
+	if (ctx->opts.alloc_check && !scroll_alloc_tracking())
+		_warn("--alloc-check needs a build with ALLOCFLAGS, not checking");
+	if (ctx->opts.profile && !scroll_prof_start(ctx->opts.profile, ctx->opts.profile_hz))
+		_warn("Can't start the profiler");
+	int64_t trace = scroll_trace_now(), phase = trace;
+
+	scroll_budget_init(&ctx->budget, ctx->opts.mem_budget);
+
+	/* Decode the image while connecting to X and enumerating the screens */
+	scroll_init_loop(ctx);
+	phase = scroll_trace_phase("init_loop", phase);
 	scroll_init_imlib(ctx);
+	phase = scroll_trace_phase("init_imlib", phase);
+	scroll_init_x11(ctx);
+	phase = scroll_trace_phase("init_x11", phase);
+	scroll_init_cache(ctx);
+	_verbose("Connected to X in %d ms", millis() - start);
+
+	scroll_handoff_adopt(ctx);
+	phase = scroll_trace_now();
 	scroll_init_screens(ctx);
+	phase = scroll_trace_phase("init_screens", phase);
+	_verbose("Screens ready after %d ms", millis() - start);
+	if (ctx->x11.full_bpp)
+		scroll_report_reduced(ctx);
 
 	/* Create bezier curve if requested */
 	if (ctx->opts.bezier)
 		scroll_bezierify(ctx);
 	else
 		scroll_copy(ctx);
+	scroll_trace_span("path", phase, scroll_trace_now(), ctx->anim.num_points);
 
 	/* Adjust speed for scale */
 	ctx->opts.speed /= ctx->opts.scale;
+
+	scroll_handoff_resume(ctx);
+	scroll_trace_phase("setup", trace);
+	scroll_trace_flush();
 }
 
 void scroll_step(struct scroll_ctx *ctx, int delta) {
@@ -450,26 +1789,14 @@ void scroll_step(struct scroll_ctx *ctx, int delta) {
 	double pos = ctx->anim.cur_time / ctx->anim.cur_travel_time;
 
 	if (ctx->anim.cur_time >= ctx->anim.cur_travel_time) {
-		++ctx->anim.cur_point;
-		ctx->anim.cur_point %= ctx->anim.num_points;
+		int point = (ctx->anim.cur_point + 1) % ctx->anim.num_points;
 
 		_debug("Overshoot: %f, %f",
-			ctx->anim.points[ctx->anim.cur_point].x - ctx->anim.cur_pos.x,
-			ctx->anim.points[ctx->anim.cur_point].y - ctx->anim.cur_pos.y);
-
-		int next_point = (ctx->anim.cur_point + 1) % ctx->anim.num_points;
-
-		ctx->anim.cur_vector.x = ctx->anim.points[next_point].x - ctx->anim.points[ctx->anim.cur_point].x;
-		ctx->anim.cur_vector.y = ctx->anim.points[next_point].y - ctx->anim.points[ctx->anim.cur_point].y;
-
-		ctx->anim.cur_travel_time = ABS(ctx->anim.cur_vector) / ctx->opts.speed;
-		ctx->anim.cur_time = 0;
-
-		_debug("Moving to point %d at (%f,%f) via vector (%f,%f) in %f millis",
-			next_point, ctx->anim.points[next_point].x, ctx->anim.points[next_point].y,
-			ctx->anim.cur_vector.x, ctx->anim.cur_vector.y,
-			ctx->anim.cur_travel_time);
+			ctx->anim.points[point].x - ctx->anim.cur_pos.x,
+			ctx->anim.points[point].y - ctx->anim.cur_pos.y);
 
+		PROBE2(segment_change, point, ctx->anim.cur_time);
+		scroll_start_segment(ctx, point);
 		return;
 	}
 
@@ -477,35 +1804,355 @@ void scroll_step(struct scroll_ctx *ctx, int delta) {
 	ctx->anim.cur_pos.y = ctx->anim.points[ctx->anim.cur_point].y + ctx->anim.cur_vector.y * pos;
 }
 
+/* Of the image window within the screen */
+static void scroll_screen_offset(struct scroll_ctx *ctx, struct scroll_screen *screen, int *x, int *y) {
+	*x = (double) -(screen->image_width - screen->width) * ctx->anim.cur_pos.x;
+	*y = (double) -(screen->image_height - screen->height) * ctx->anim.cur_pos.y;
+}
+
 void scroll_draw(struct scroll_ctx *ctx) {
 	for (int i = 0; i < ctx->num_screens; ++i) {
-		XMoveWindow(ctx->x11.display,
-			ctx->screens[i]->image_window,
-			(double) -(ctx->screens[i]->image_width - ctx->screens[i]->width) * ctx->anim.cur_pos.x,
-			(double) -(ctx->screens[i]->image_height - ctx->screens[i]->height) * ctx->anim.cur_pos.y);
+		int x, y;
+		scroll_screen_offset(ctx, ctx->screens[i], &x, &y);
+		XMoveWindow(ctx->x11.display, ctx->screens[i]->image_window, x, y);
 	}
+}
 
-	XSync(ctx->x11.display, False);
+void scroll_publish_status(struct scroll_ctx *ctx) {
+	struct scroll_status status;
+
+	status.frames = ctx->timing.stats.frames;
+	status.x = ctx->anim.cur_pos.x;
+	status.y = ctx->anim.cur_pos.y;
+	status.point = ctx->anim.cur_point;
+	status.num_points = ctx->anim.num_points;
+	status.time = ctx->anim.cur_time;
+	status.fps = ctx->timing.fps;
+	status.num_screens = MIN(ctx->num_screens, STATUS_MAX_SCREENS);
+
+	for (int i = 0; i < status.num_screens; ++i) {
+		struct scroll_screen *screen = ctx->screens[i];
+		struct scroll_status_screen *out = &status.screens[i];
+		int x, y;
+
+		scroll_screen_offset(ctx, screen, &x, &y);
+		*out = (struct scroll_status_screen) { screen->x, screen->y, screen->width, screen->height, x, y };
+	}
+
+	scroll_status_publish(&ctx->status, &status);
 }
 
-void scroll_run(struct scroll_ctx *ctx) {
-	int millis_per_frame = 1000 / ctx->opts.fps;
-	int last;
-	int delta = 1000;
+void scroll_set_fps(struct scroll_ctx *ctx, int fps) {
+	ctx->timing.fps = fps;
+
+	/* Pretend a frame just passed so the animation doesn't jump when resuming */
+	ctx->timing.last = millis() - (fps ? 1000 / fps : 0);
+	ctx->timing.interval = fps ? 1000000000L / fps : 0;
+	scroll_timer_set(ctx->timing.frame_timer, ctx->timing.interval);
 
-	for (;;) {
-		if (delta >= millis_per_frame) {
-			last = millis();
-			scroll_step(ctx, delta);
-			scroll_draw(ctx);
+	/* The timer fires right away */
+	ctx->timing.deadline = fps ? nanos() : 0;
+	ctx->timing.last_start = 0;
+
+	/* No frames while paused, so readers see the rate change from here */
+	scroll_publish_status(ctx);
+}
+
+void scroll_report_frames(struct scroll_ctx *ctx) {
+	struct scroll_frame_stats *stats = &ctx->timing.stats;
+
+	_log("Frames: %llu, %llu dropped, %llu overran the frame period",
+		(unsigned long long) stats->frames, (unsigned long long) stats->dropped,
+		(unsigned long long) stats->overrun);
+
+	for (int i = 0; i < FRAME_END; i++) {
+		struct scroll_hist *hist = &stats->hists[i];
+		_log("Frames: %-8s p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, p99.9 %.2f ms, max %.2f ms",
+			frame_metric_names[i],
+			scroll_hist_percentile(hist, 50) / 1000.0, scroll_hist_percentile(hist, 90) / 1000.0,
+			scroll_hist_percentile(hist, 99) / 1000.0, scroll_hist_percentile(hist, 99.9) / 1000.0,
+			hist->max / 1000.0);
+	}
+}
+
+void scroll_dump_status(struct scroll_ctx *ctx) {
+	_log("Point %d of %d at (%f; %f), %d fps, %d screens",
+		ctx->anim.cur_point, ctx->anim.num_points,
+		ctx->anim.cur_pos.x, ctx->anim.cur_pos.y,
+		ctx->timing.fps, ctx->num_screens);
+	scroll_report_frames(ctx);
+	scroll_xstats_report(&ctx->x11.stats);
+	scroll_alloc_report(ctx->timing.stats.frames);
+	scroll_perf_report();
+	scroll_report_memory(ctx);
+}
+
+void scroll_process_x11(struct scroll_ctx *ctx) {
+	XEvent ev;
+
+	while (XPending(ctx->x11.display)) {
+		XNextEvent(ctx->x11.display, &ev);
+
+#ifdef XRANDR
+		if (ctx->x11.randr_event_base >= 0) {
+			if (ev.type == ctx->x11.randr_event_base + RRScreenChangeNotify) {
+				XRRUpdateConfiguration(&ev);
+				ctx->x11.screens_changed = 1;
+				continue;
+			} else if (ev.type == ctx->x11.randr_event_base + RRNotify) {
+				ctx->x11.screens_changed = 1;
+				continue;
+			}
+		}
+#endif
+
+		switch (ev.type) {
+		case ConfigureNotify:
+			if (ev.xconfigure.window != ctx->x11.root ||
+				(ev.xconfigure.width == ctx->x11.width && ev.xconfigure.height == ctx->x11.height))
+				break;
+
+			_debug("Root window resized to (%d; %d)", ev.xconfigure.width, ev.xconfigure.height);
+			ctx->x11.width = ev.xconfigure.width;
+			ctx->x11.height = ev.xconfigure.height;
+			ctx->x11.screens_changed = 1;
+			break;
+		default:
+			break;
 		}
+	}
+
+	/* A hotplug produces a burst of events, only update once it has been read */
+	if (ctx->x11.screens_changed) {
+		ctx->x11.screens_changed = 0;
+		scroll_update_screens(ctx);
+	}
+}
+
+/* Served from the loop on every scrape */
+static void scroll_collect_metrics(struct scroll_metrics *metrics, void *data) {
+	struct scroll_ctx *ctx = data;
+	struct scroll_frame_stats *stats = &ctx->timing.stats;
+	size_t pixmaps = 0;
+	long rss, peak;
+
+	scroll_metrics_value(metrics, "scroll_frames_total", "counter", "Frames rendered", stats->frames);
+	scroll_metrics_value(metrics, "scroll_frames_dropped_total", "counter",
+		"Timer expirations without a frame of their own", stats->dropped);
+	scroll_metrics_value(metrics, "scroll_frames_overrun_total", "counter",
+		"Frames which took longer than the frame period", stats->overrun);
+	scroll_metrics_value(metrics, "scroll_fps", "gauge", "Current frame rate", ctx->timing.fps);
+
+	scroll_metrics_value(metrics, "scroll_path_point", "gauge", "Point the current path segment starts at",
+		ctx->anim.cur_point);
+	scroll_metrics_header(metrics, "scroll_path_position", "gauge", "Position on the image from 0 to 1");
+	scroll_metrics_printf(metrics, "scroll_path_position{axis=\"x\"} %f\nscroll_path_position{axis=\"y\"} %f\n",
+		ctx->anim.cur_pos.x, ctx->anim.cur_pos.y);
+
+	scroll_metrics_header(metrics, "scroll_screen_pixmap_bytes", "gauge", "Size of the pixmap shown on the screen");
+	for (int i = 0; i < ctx->num_screens; i++) {
+		struct scroll_screen *screen = ctx->screens[i];
+		scroll_metrics_printf(metrics, "scroll_screen_pixmap_bytes{screen=\"%d\",geometry=\"%dx%d+%d+%d\"} %zu\n",
+			i, screen->width, screen->height, screen->x, screen->y, scroll_pixmap_bytes(ctx, screen->pixmap));
+	}
+
+	for (struct scroll_pixmap *p = ctx->pixmaps; p; p = p->next)
+		pixmaps += scroll_pixmap_bytes(ctx, p);
+	scroll_metrics_value(metrics, "scroll_pixmap_bytes", "gauge", "Size of all pixmaps, shared ones counted once",
+		pixmaps);
+
+	if (scroll_read_rss(&rss, &peak)) {
+		scroll_metrics_value(metrics, "scroll_resident_bytes", "gauge", "Resident memory", rss * 1024.0);
+		scroll_metrics_value(metrics, "scroll_resident_peak_bytes", "gauge", "Peak resident memory", peak * 1024.0);
+	}
+
+	scroll_metrics_value(metrics, "scroll_decode_seconds", "gauge", "Duration of the last decode",
+		ctx->loader.millis / 1000.0);
+	scroll_metrics_value(metrics, "scroll_scale_seconds", "gauge", "Duration of the slowest image in the last scaling",
+		ctx->timing.scale_millis / 1000.0);
+	scroll_metrics_value(metrics, "scroll_screen_updates_total", "counter",
+		"Screen updates at startup, on monitor changes and on SIGHUP", ctx->x11.screen_updates);
+
+	/* Only Xlib so far, the label keeps series apart once there are other backends */
+	scroll_metrics_header(metrics, "scroll_x11_requests_total", "counter", "X requests sent by frames");
+	scroll_metrics_printf(metrics, "scroll_x11_requests_total{backend=\"xlib\"} %llu\n",
+		(unsigned long long) ctx->x11.stats.total_requests);
+	scroll_metrics_header(metrics, "scroll_x11_bytes_total", "counter", "Bytes of X requests sent by frames");
+	scroll_metrics_printf(metrics, "scroll_x11_bytes_total{backend=\"xlib\"} %llu\n",
+		(unsigned long long) ctx->x11.stats.total_bytes);
+	scroll_metrics_header(metrics, "scroll_x11_round_trips_total", "counter", "Round trips to the X server in frames");
+	scroll_metrics_printf(metrics, "scroll_x11_round_trips_total{backend=\"xlib\"} %llu\n",
+		(unsigned long long) ctx->x11.stats.round_trips);
+}
+
+static void scroll_on_x11(int fd, unsigned int events, void *data) {
+	scroll_process_x11(data);
+}
+
+static void scroll_on_frame(int fd, unsigned int events, void *data) {
+	struct scroll_ctx *ctx = data;
+	struct scroll_frame_stats *stats = &ctx->timing.stats;
+	uint64_t expirations = scroll_timer_read(fd);
+	int64_t start_ns = nanos();
+	int64_t start = start_ns / 1000;
+	int64_t period = ctx->timing.interval / 1000;
+	int64_t lateness = -1;
+	PROBE2(frame_begin, stats->frames, expirations);
+
+	/* The last expiry is this frame's deadline, frames for earlier ones were dropped */
+	if (expirations && ctx->timing.deadline) {
+		int64_t deadline = ctx->timing.deadline + (int64_t) (expirations - 1) * ctx->timing.interval;
+		lateness = MAX(start_ns - deadline, 0) / 1000;
+		scroll_hist_add(&stats->hists[FRAME_LATENESS], lateness);
+		stats->dropped += expirations - 1;
+		ctx->timing.deadline = deadline + ctx->timing.interval;
+	}
+
+	scroll_xstats_begin(&ctx->x11.stats, ctx->x11.display);
+	struct scroll_perf_sample perf;
+	int now = millis();
+	scroll_alloc_phase(ALLOC_STEP);
+	scroll_perf_begin(&perf);
+	scroll_step(ctx, now - ctx->timing.last);
+	scroll_perf_end(&perf, PERF_STEP);
+	ctx->timing.last = now;
+	int64_t stepped = micros();
+
+	scroll_alloc_phase(ALLOC_DRAW);
+	scroll_perf_begin(&perf);
+	scroll_draw(ctx);
+	scroll_perf_end(&perf, PERF_DRAW);
+	int64_t drawn = micros();
+	PROBE2(backend_submit, stats->frames, ctx->num_screens);
+	scroll_alloc_phase(ALLOC_SYNC);
+	scroll_xstats_sync(&ctx->x11.stats, ctx->x11.display);
+	scroll_alloc_phase(ALLOC_OTHER);
+	int64_t complete = micros();
+	PROBE3(frame_end, stats->frames, lateness, complete - start);
+
+	scroll_hist_add(&stats->hists[FRAME_STEP], stepped - start);
+	scroll_hist_add(&stats->hists[FRAME_DRAW], drawn - stepped);
+	scroll_hist_add(&stats->hists[FRAME_COMPLETE], complete - drawn);
+	if (ctx->timing.last_start)
+		scroll_hist_add(&stats->hists[FRAME_INTERVAL], start - ctx->timing.last_start);
+	ctx->timing.last_start = start;
+
+	if (complete - start > period)
+		++stats->overrun;
+	scroll_xstats_end(&ctx->x11.stats, ctx->x11.display);
+	if (ctx->opts.alloc_check)
+		scroll_alloc_check(stats->frames >= ALLOC_WARMUP_FRAMES);
+
+	if (stats->frames++ % TRACE_FRAME_INTERVAL == 0 && scroll_tracing()) {
+		scroll_trace_span("step", start, stepped, -1);
+		scroll_trace_span("draw", stepped, drawn, ctx->num_screens);
+		scroll_trace_span("sync", drawn, complete, -1);
+		scroll_trace_flush();
+	}
+
+	scroll_publish_status(ctx);
+
+	/* XSync may have moved events into the queue without the fd becoming readable */
+	scroll_process_x11(ctx);
+}
+
+static void scroll_on_refined(int fd, unsigned int events, void *data) {
+	struct scroll_ctx *ctx = data;
+	scroll_refine_finish(ctx);
+
+	/* Sizes whose screens disappeared while scaling */
+	scroll_sweep_pixmaps(ctx);
+	scroll_release_image(ctx);
+}
+
+static void scroll_on_power(int fd, unsigned int events, void *data) {
+	struct scroll_ctx *ctx = data;
+	scroll_timer_read(fd);
+
+	/* Switch between the normal and the battery frame rate */
+	int fps = scroll_power_low() ? ctx->opts.battery_fps : ctx->opts.fps;
+	if (fps != ctx->timing.fps) {
+		_log("Power state changed, running at %d fps", fps);
+		scroll_set_fps(ctx, fps);
+	}
+}
 
-		while (millis_per_frame > millis() - last) {
-			usleep(1000);
+static void scroll_on_signal(int fd, unsigned int events, void *data) {
+	struct scroll_ctx *ctx = data;
+	int sig;
+
+	while ((sig = scroll_signal_read(fd))) {
+		switch (sig) {
+		case SIGTERM:
+		case SIGINT:
+			_log("Exiting");
+			scroll_loop_stop(&ctx->loop);
+			break;
+		case SIGHUP:
+			scroll_rebuild_screens(ctx);
+			break;
+		case SIGUSR1:
+			scroll_dump_status(ctx);
+			break;
+		case SIGUSR2:
+			scroll_prof_write();
+			break;
 		}
+	}
+}
 
-		delta = millis() - last;
+void scroll_run(struct scroll_ctx *ctx) {
+	scroll_loop_add(&ctx->loop, ConnectionNumber(ctx->x11.display), scroll_on_x11, ctx);
+	scroll_loop_add(&ctx->loop, ctx->signal_fd, scroll_on_signal, ctx);
+	scroll_loop_add(&ctx->loop, ctx->timing.frame_timer, scroll_on_frame, ctx);
+	scroll_loop_add(&ctx->loop, ctx->refine.event_fd, scroll_on_refined, ctx);
+
+	if (ctx->timing.power_timer >= 0) {
+		scroll_loop_add(&ctx->loop, ctx->timing.power_timer, scroll_on_power, ctx);
+		scroll_timer_set(ctx->timing.power_timer, POWER_POLL_MILLIS * 1000000L);
 	}
+
+	if ((ctx->opts.metrics || ctx->opts.metrics_port) &&
+		!scroll_metrics_init(&ctx->metrics, &ctx->loop, ctx->opts.metrics, ctx->opts.metrics_port,
+			scroll_collect_metrics, ctx))
+		_warn("Not serving metrics");
+	if (ctx->opts.status)
+		scroll_status_open(&ctx->status, ctx->opts.status);
+
+	scroll_set_fps(ctx, ctx->opts.fps);
+
+	/* Handle events which arrived during setup */
+	scroll_process_x11(ctx);
+	scroll_loop_run(&ctx->loop);
+}
+
+void scroll_cleanup(struct scroll_ctx *ctx) {
+	/* Never hand off a preview */
+	scroll_refine_finish(ctx);
+
+	/* Handed off windows and pixmaps stay on the server, only the process memory goes away */
+	if (ctx->opts.handoff)
+		scroll_handoff_publish(ctx);
+	else
+		scroll_free_screens(ctx);
+
+	scroll_image_wait(&ctx->loader);
+	scroll_image_free(&ctx->image);
+	XFreeGC(ctx->x11.display, ctx->x11.gc);
+	XCloseDisplay(ctx->x11.display);
+
+	close(ctx->timing.frame_timer);
+	close(ctx->refine.event_fd);
+	if (ctx->timing.power_timer >= 0)
+		close(ctx->timing.power_timer);
+	close(ctx->signal_fd);
+	if (ctx->opts.metrics || ctx->opts.metrics_port)
+		scroll_metrics_free(&ctx->metrics);
+	scroll_status_close(&ctx->status);
+	scroll_loop_free(&ctx->loop);
+	scroll_budget_free(&ctx->budget);
+	scroll_trace_close();
+	scroll_prof_stop();
 }
 
 int main(int argc, char **argv) {
@@ -513,13 +2160,15 @@ int main(int argc, char **argv) {
 	scroll_init_ctx(&ctx);
 
 	scroll_parse_args(&ctx, argc, argv);
+	scroll_log_start(ctx.opts.journal);
 	scroll_setup(&ctx);
 #ifdef DEBUG
-	_debug("Points:");
+	_debug_all("Points:");
 	for (int i = 0; i < ctx.anim.num_points; i++) {
-	  _debug("(%f, %f)", ctx.anim.points[i].x, ctx.anim.points[i].y);
+	  _debug_all("(%f, %f)", ctx.anim.points[i].x, ctx.anim.points[i].y);
 	}
 #endif
 	scroll_run(&ctx);
+	scroll_cleanup(&ctx);
 	return 0;
 }
@@ -0,0 +1,76 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "status.h"
+#include "utils.h"
+
+int scroll_status_open(struct scroll_status_writer *writer, const char *name) {
+	writer->page = NULL;
+
+	/* shm_open wants a leading slash */
+	writer->name = malloc(strlen(name) + 2);
+	_check_or_die(writer->name, "Failed to allocate status name");
+	writer->name[0] = '/';
+	strcpy(writer->name + 1, name[0] == '/' ? name + 1 : name);
+
+	int fd = shm_open(writer->name, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		_warn("Can't open status page %s: %s", writer->name, strerror(errno));
+		goto error;
+	}
+
+	if (ftruncate(fd, sizeof(struct scroll_status_page))) {
+		_warn("Can't size status page %s: %s", writer->name, strerror(errno));
+		close(fd);
+		goto error;
+	}
+
+	void *page = mmap(NULL, sizeof(struct scroll_status_page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED) {
+		_warn("Can't map status page %s: %s", writer->name, strerror(errno));
+		shm_unlink(writer->name);
+		goto error;
+	}
+
+	writer->page = page;
+	memset(writer->page, 0, sizeof(struct scroll_status_page));
+	writer->page->version = STATUS_VERSION;
+	/* Last, readers ignore the page until then */
+	__atomic_store_n(&writer->page->magic, STATUS_MAGIC, __ATOMIC_RELEASE);
+	return 1;
+
+error:
+	free(writer->name);
+	writer->name = NULL;
+	return 0;
+}
+
+/* Never blocks, readers don't write to the page */
+void scroll_status_publish(struct scroll_status_writer *writer, const struct scroll_status *status) {
+	if (!writer->page)
+		return;
+
+	uint32_t latest = writer->page->latest;
+	struct scroll_status_slot *slot = &writer->page->slots[(latest + 1) % 2];
+
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&slot->status, status, sizeof(struct scroll_status));
+	__atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&writer->page->latest, latest + 1, __ATOMIC_RELEASE);
+}
+
+void scroll_status_close(struct scroll_status_writer *writer) {
+	if (!writer->page)
+		return;
+
+	munmap(writer->page, sizeof(struct scroll_status_page));
+	shm_unlink(writer->name);
+	free(writer->name);
+	writer->page = NULL;
+}
@@ -0,0 +1,82 @@
+#ifndef __status_h__
+#define __status_h__
+
+#include <stdint.h>
+#include <string.h>
+
+/* Shared memory page with the animation state, rewritten every frame.
+ * Readers map it read-only and copy it out with scroll_status_read. */
+
+#define STATUS_MAGIC 0x6c726373
+#define STATUS_VERSION 1
+#define STATUS_MAX_SCREENS 16
+/* Reads give up after this many tries instead of waiting for the writer */
+#define STATUS_READ_TRIES 4
+
+struct scroll_status_screen {
+	int32_t x, y;
+	int32_t width, height;
+	/* Of the image window, zero or negative */
+	int32_t offset_x, offset_y;
+};
+
+struct scroll_status {
+	uint64_t frames;
+	/* Position on the image from 0 to 1 */
+	double x, y;
+	int32_t point;
+	int32_t num_points;
+	/* Milliseconds into the current segment */
+	int32_t time;
+	int32_t fps;
+	int32_t num_screens;
+	struct scroll_status_screen screens[STATUS_MAX_SCREENS];
+};
+
+/* Seqlocked, seq is odd while the writer fills the slot */
+struct scroll_status_slot {
+	uint32_t seq;
+	uint32_t pad;
+	struct scroll_status status;
+};
+
+/* The writer alternates between the slots and then points latest at the
+ * one it filled, so a read only fails if it takes longer than a frame */
+struct scroll_status_page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t latest;
+	uint32_t pad;
+	struct scroll_status_slot slots[2];
+};
+
+struct scroll_status_writer {
+	struct scroll_status_page *page;
+	char *name;
+};
+
+int scroll_status_open(struct scroll_status_writer *writer, const char *name);
+void scroll_status_publish(struct scroll_status_writer *writer, const struct scroll_status *status);
+void scroll_status_close(struct scroll_status_writer *writer);
+
+/* Wait-free, returns 0 if the writer kept overwriting the copy */
+static inline int scroll_status_read(const struct scroll_status_page *page, struct scroll_status *status) {
+	if (__atomic_load_n(&page->magic, __ATOMIC_ACQUIRE) != STATUS_MAGIC || page->version != STATUS_VERSION)
+		return 0;
+
+	for (int i = 0; i < STATUS_READ_TRIES; ++i) {
+		const struct scroll_status_slot *slot = &page->slots[__atomic_load_n(&page->latest, __ATOMIC_ACQUIRE) % 2];
+		uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq % 2)
+			continue;
+
+		memcpy(status, &slot->status, sizeof(struct scroll_status));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			return 1;
+	}
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,167 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "utils.h"
+
+enum {
+	RING_FREE = 0,
+	RING_USED,
+	/* The thread exited, the ring is free once flushed */
+	RING_EXITED
+};
+
+/* Name must be a string literal, only the pointer is kept */
+struct scroll_trace_event {
+	const char *name;
+	int64_t start, end;
+	int arg;
+};
+
+/* Written by its thread only and read by the flushing thread, head and tail are the only shared state */
+struct scroll_trace_ring {
+	struct scroll_trace_event events[TRACE_RING_EVENTS];
+	uint32_t head;
+	uint32_t tail;
+	int state;
+	int tid;
+};
+
+static struct {
+	FILE *file;
+	int pid;
+	int events;
+	uint64_t dropped;
+	struct scroll_trace_ring *rings;
+	pthread_key_t key;
+} trace;
+
+static __thread struct scroll_trace_ring *thread_ring;
+
+static void scroll_trace_thread_exit(void *data) {
+	struct scroll_trace_ring *ring = data;
+	__atomic_store_n(&ring->state, RING_EXITED, __ATOMIC_RELEASE);
+}
+
+int scroll_trace_open(const char *path) {
+	trace.file = fopen(path, "w");
+	if (!trace.file)
+		return 0;
+
+	trace.rings = calloc(TRACE_MAX_THREADS, sizeof(struct scroll_trace_ring));
+	_check_or_die(trace.rings, "Failed to allocate trace buffers");
+	pthread_key_create(&trace.key, scroll_trace_thread_exit);
+
+	trace.pid = getpid();
+	trace.events = 0;
+	trace.dropped = 0;
+	fputs("[", trace.file);
+	return 1;
+}
+
+int scroll_tracing(void) {
+	return trace.file != NULL;
+}
+
+/* Timestamp for scroll_trace_span, 0 if not tracing */
+int64_t scroll_trace_now(void) {
+	return trace.file ? micros() : 0;
+}
+
+/* Claims a ring on the thread's first event */
+static struct scroll_trace_ring *scroll_trace_ring(void) {
+	if (thread_ring)
+		return thread_ring;
+
+	for (int i = 0; i < TRACE_MAX_THREADS; ++i) {
+		struct scroll_trace_ring *ring = &trace.rings[i];
+		int state = RING_FREE;
+
+		if (__atomic_compare_exchange_n(&ring->state, &state, RING_USED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			ring->tid = syscall(SYS_gettid);
+			pthread_setspecific(trace.key, ring);
+			thread_ring = ring;
+			return ring;
+		}
+	}
+
+	return NULL;
+}
+
+/* Records a span from a scroll_trace_now timestamp, arg is shown unless it is negative */
+void scroll_trace_span(const char *name, int64_t start, int64_t end, int arg) {
+	if (!start || !trace.file)
+		return;
+
+	struct scroll_trace_ring *ring = scroll_trace_ring();
+	uint32_t head = ring ? ring->head : 0;
+
+	if (!ring || head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= TRACE_RING_EVENTS) {
+		__atomic_add_fetch(&trace.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	ring->events[head % TRACE_RING_EVENTS] = (struct scroll_trace_event) { name, start, end, arg };
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* Records a span ending now and returns now, to chain consecutive phases */
+int64_t scroll_trace_phase(const char *name, int64_t start) {
+	int64_t now = scroll_trace_now();
+	scroll_trace_span(name, start, now, -1);
+	return now;
+}
+
+/* Writes the buffered events of every thread, only called from the main thread */
+void scroll_trace_flush(void) {
+	if (!trace.file)
+		return;
+
+	for (int i = 0; i < TRACE_MAX_THREADS; ++i) {
+		struct scroll_trace_ring *ring = &trace.rings[i];
+		int state = __atomic_load_n(&ring->state, __ATOMIC_ACQUIRE);
+		if (state == RING_FREE)
+			continue;
+
+		uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (uint32_t tail = ring->tail; tail != head; ++tail) {
+			struct scroll_trace_event *ev = &ring->events[tail % TRACE_RING_EVENTS];
+
+			fprintf(trace.file, "%s\n{\"name\":\"%s\",\"cat\":\"scroll\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+				"\"pid\":%d,\"tid\":%d", trace.events++ ? "," : "", ev->name,
+				(long long) ev->start, (long long) (ev->end - ev->start), trace.pid, ring->tid);
+			if (ev->arg >= 0)
+				fprintf(trace.file, ",\"args\":{\"n\":%d}", ev->arg);
+			fputs("}", trace.file);
+		}
+		__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+		/* Nothing can be added after the thread exited */
+		if (state == RING_EXITED) {
+			ring->head = ring->tail = 0;
+			__atomic_store_n(&ring->state, RING_FREE, __ATOMIC_RELEASE);
+		}
+	}
+
+	fflush(trace.file);
+}
+
+void scroll_trace_close(void) {
+	if (!trace.file)
+		return;
+
+	scroll_trace_flush();
+	fputs("\n]\n", trace.file);
+	fclose(trace.file);
+	trace.file = NULL;
+
+	uint64_t dropped = __atomic_load_n(&trace.dropped, __ATOMIC_RELAXED);
+	if (dropped)
+		_warn("Dropped %llu trace events, the buffers were full", (unsigned long long) dropped);
+
+	free(trace.rings);
+	pthread_key_delete(trace.key);
+}
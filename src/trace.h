@@ -0,0 +1,23 @@
+#ifndef __trace_h__
+#define __trace_h__
+
+#include <stdint.h>
+
+/* Events per thread between two flushes */
+#define TRACE_RING_EVENTS 2048
+/* Threads tracing at the same time, further threads drop their events */
+#define TRACE_MAX_THREADS 16
+/* Every n-th frame is traced */
+#define TRACE_FRAME_INTERVAL 16
+
+/* Chrome trace event JSON, open with chrome://tracing or ui.perfetto.dev */
+int scroll_trace_open(const char *path);
+void scroll_trace_flush(void);
+void scroll_trace_close(void);
+
+int scroll_tracing(void);
+int64_t scroll_trace_now(void);
+void scroll_trace_span(const char *name, int64_t start, int64_t end, int arg);
+int64_t scroll_trace_phase(const char *name, int64_t start);
+
+#endif
@@ -1,18 +1,24 @@
 #ifndef __utils_h__
 #define __utils_h__
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 
-#ifdef DEBUG
-#define _debug(M, ...) printf("DEBUG: %s:%d " M "\n", __FILE__, __LINE__, ##__VA_ARGS__)
-#else
-#define _debug(M, ...)
-#endif
+#include "log.h"
+
+/* Set by -v */
+extern int scroll_verbose;
 
-#define _err(M, ...) fprintf(stderr, "ERROR: " M "\n", ##__VA_ARGS__)
-#define _warn(M, ...) fprintf(stderr, "WARNING: " M "\n", ##__VA_ARGS__)
-#define _log(M, ...) fprintf(stderr, "INFO: " M "\n", ##__VA_ARGS__)
+/* Formatted later on the logger thread, see log.h. Debug and verbose messages
+ * may come from the frame loop and are rate limited, _debug_all is for dumps. */
+#define _debug(M, ...) _log_at(LEVEL_DEBUG, 1, M, ##__VA_ARGS__)
+#define _debug_all(M, ...) _log_at(LEVEL_DEBUG, 0, M, ##__VA_ARGS__)
+#define _err(M, ...) _log_at(LEVEL_ERROR, 0, M, ##__VA_ARGS__)
+#define _warn(M, ...) _log_at(LEVEL_WARN, 0, M, ##__VA_ARGS__)
+#define _log(M, ...) _log_at(LEVEL_INFO, 0, M, ##__VA_ARGS__)
+#define _verbose(M, ...) do { if (scroll_verbose) _log_at(LEVEL_INFO, 1, M, ##__VA_ARGS__); } while (0)
 
 #define _check(A, M, ...)  if(!(A)) {\
     _err(M, ##__VA_ARGS__);\
@@ -24,4 +30,39 @@
     exit(1);\
 }
 
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+/* FNV-1a, chain calls by passing the previous result */
+static inline uint64_t hash_bytes(const void *data, size_t len, uint64_t hash) {
+	const unsigned char *p = data;
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static inline int millis(void) {
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return spec.tv_sec * 1000 + spec.tv_nsec / 1000000;
+}
+
+static inline int64_t micros(void) {
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return (int64_t) spec.tv_sec * 1000000 + spec.tv_nsec / 1000;
+}
+
+static inline int64_t nanos(void) {
+	struct timespec spec;
+	clock_gettime(CLOCK_MONOTONIC, &spec);
+	return (int64_t) spec.tv_sec * 1000000000 + spec.tv_nsec;
+}
+
 #endif
@@ -0,0 +1,60 @@
+#include <X11/Xlibint.h>
+
+#include "utils.h"
+#include "xstats.h"
+
+/* Requests in Xlib's output buffer, sent with the next flush. Only Xlib's
+ * private display struct knows, which is why this lives in a file of its own. */
+static size_t scroll_xstats_queued(Display *display) {
+	return display->bufptr - display->buffer;
+}
+
+void scroll_xstats_begin(struct scroll_xstats *stats, Display *display) {
+	stats->start_request = XNextRequest(display);
+	stats->start_queued = scroll_xstats_queued(display);
+	stats->frame_bytes = 0;
+	stats->frame_round_trips = 0;
+}
+
+/* XSync, counting what it flushes and its round trip */
+void scroll_xstats_sync(struct scroll_xstats *stats, Display *display) {
+	size_t queued = scroll_xstats_queued(display);
+
+	/* Plus the GetInputFocus request XSync waits for */
+	stats->frame_bytes += (queued > stats->start_queued ? queued - stats->start_queued : 0) + sz_xReq;
+	++stats->frame_round_trips;
+	XSync(display, False);
+	stats->start_queued = scroll_xstats_queued(display);
+}
+
+void scroll_xstats_end(struct scroll_xstats *stats, Display *display) {
+	size_t queued = scroll_xstats_queued(display);
+	unsigned long next = XNextRequest(display);
+	unsigned long requests = next - stats->start_request;
+	unsigned long in_flight = next - 1 - LastKnownRequestProcessed(display);
+
+	/* Still buffered, they go out with this frame's flush anyway */
+	if (queued > stats->start_queued)
+		stats->frame_bytes += queued - stats->start_queued;
+
+	scroll_hist_add(&stats->requests, requests);
+	scroll_hist_add(&stats->bytes, stats->frame_bytes);
+	++stats->frames;
+	stats->total_requests += requests;
+	stats->total_bytes += stats->frame_bytes;
+	stats->round_trips += stats->frame_round_trips;
+	if (in_flight > stats->max_in_flight)
+		stats->max_in_flight = in_flight;
+}
+
+void scroll_xstats_report(struct scroll_xstats *stats) {
+	double frames = stats->frames ? stats->frames : 1;
+
+	_log("X11: per frame %.1f requests (p99 %llu, max %llu), %.1f bytes (p99 %llu, max %llu), %.2f round trips",
+		stats->total_requests / frames,
+		(unsigned long long) scroll_hist_percentile(&stats->requests, 99), (unsigned long long) stats->requests.max,
+		stats->total_bytes / frames,
+		(unsigned long long) scroll_hist_percentile(&stats->bytes, 99), (unsigned long long) stats->bytes.max,
+		stats->round_trips / frames);
+	_log("X11: up to %lu requests unprocessed at the end of a frame", stats->max_in_flight);
+}
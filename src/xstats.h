@@ -0,0 +1,34 @@
+#ifndef __xstats_h__
+#define __xstats_h__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <X11/Xlib.h>
+
+#include "hist.h"
+
+/* X protocol traffic per frame */
+struct scroll_xstats {
+	struct scroll_hist requests;
+	struct scroll_hist bytes;
+	uint64_t frames;
+	uint64_t total_requests;
+	uint64_t total_bytes;
+	uint64_t round_trips;
+	/* Requests the server hadn't processed when a frame ended */
+	unsigned long max_in_flight;
+
+	/* The current frame */
+	unsigned long start_request;
+	size_t start_queued;
+	size_t frame_bytes;
+	uint64_t frame_round_trips;
+};
+
+void scroll_xstats_begin(struct scroll_xstats *stats, Display *display);
+void scroll_xstats_sync(struct scroll_xstats *stats, Display *display);
+void scroll_xstats_end(struct scroll_xstats *stats, Display *display);
+void scroll_xstats_report(struct scroll_xstats *stats);
+
+#endif